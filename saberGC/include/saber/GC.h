@@ -1,9 +1,12 @@
 ﻿// saber/GC.h
 #pragma once
 
+#include <chrono>
 #include <cstddef>
+#include <iosfwd>
 #include <memory>
 #include <memory_resource>
+#include <optional>
 #include <type_traits>
 #include <utility>
 #include <variant>
@@ -38,10 +41,20 @@ constexpr void destroy_at(T* p)
 } // namespace emulated
 
 
+// Specialize to true for types whose objects can be saved in heap images.
+// They must be copyable byte by byte except members of GC::Object, and destructible by only destructing those members.
+template <class T>
+struct is_relocatable : std::is_trivially_copyable<T> {};
+template <class T>
+constexpr bool is_relocatable_v = is_relocatable<T>::value;
+
+
 class GC
 {
 public:
 	template <class T> class Object;
+	template <class T> class Local;
+	class Region;
 
 public:
 	explicit GC(std::pmr::memory_resource* resource = nullptr);
@@ -60,24 +73,73 @@ public:
 	// Destructs and deallocates unreferenced objects explicitly.
 	void collect();
 
+	// Sets the size in bytes from which objects are mapped directly from the OS, apart from the memory resource.
+	void set_large_object_threshold(const std::size_t bytes) noexcept;
+
+	// Sets the size in bytes of the heap over which garbages are collected proactively.
+	void set_soft_heap_limit(const std::size_t bytes) noexcept;
+
+	// Sets the size in bytes of the heap over which allocations throw std::bad_alloc after collecting all garbages.
+	// Destructors of garbages being collected by other threads are waited for, so they must not wait for a thread allocating.
+	void set_hard_heap_limit(const std::size_t bytes) noexcept;
+
+	// Sets the size in bytes of free memory retained for reuse after collection. The rest is returned.
+	void set_heap_retention(const std::size_t bytes) noexcept;
+
+	// Returns the size in bytes of memory allocated for the heap.
+	std::size_t get_heap_bytes() const noexcept;
+
+	// Enables reclaiming objects as soon as they are no longer referred, leaving only cyclic garbages to collect().
+	void set_reference_counting(const bool enabled);
+
+	// Starts writing a binary trace of object operations and collections to the stream.
+	void start_trace(std::ostream& stream);
+
+	// Stops writing the trace, and returns false if writing any of it has failed.
+	bool stop_trace();
+
+	// Re-executes a trace against this GC, and returns the elapsed time, or nothing if the trace is invalid, truncated or corrupt.
+	std::optional<std::chrono::nanoseconds> replay_trace(std::istream& stream);
+
+	// Writes the objects reachable from the root to the stream as an image, unless any of them is not relocatable.
+	// They are copied before writing without blocking other threads, which must not modify them until this returns.
+	template <class T>
+	bool save_image(std::ostream& stream, const Object<T>& root);
+
+	// Maps the image file, and returns its root. Objects in it are relocated in place instead of being constructed.
+	// The root is null if the image is invalid, or was saved from a root of another size, alignment or arrayness.
+	template <class T>
+	Object<T> load_image(const char* path);
+
 private:
 	class BaseObject;
+	class BaseLocal;
+	class ShadowStack;
 	class Impl;
 
+private:
+	bool save_image(std::ostream& stream, const BaseObject& root, const std::size_t size, const std::size_t alignment, const bool is_array);
+	void load_image(const char* path, BaseObject& root, const std::size_t size, const std::size_t alignment, const bool is_array);
+
 private:
 	std::shared_ptr<Impl> impl_;
 };
 
 class GC::BaseObject
 {
+	friend BaseLocal;
+	friend Impl;
+
 public:
 	BaseObject() noexcept;
 	BaseObject(const std::shared_ptr<Impl>& impl, const std::size_t size, const std::size_t alignment, const std::size_t count);
 	BaseObject(const BaseObject& other);
+	explicit BaseObject(const BaseLocal& local);
 	~BaseObject();
 	BaseObject& operator=(const BaseObject& rhs);
+	BaseObject& operator=(const BaseLocal& rhs);
 
-	void set_destructor(void(*destructor)(void*, const std::size_t), const std::size_t count);
+	void set_destructor(void(*destructor)(void*, const std::size_t), const std::size_t count, const bool is_relocatable);
 	void reset();
 
 protected:
@@ -94,6 +156,7 @@ class GC::Object : protected GC::BaseObject
 	static_assert(!std::is_array_v<T> && !std::is_void_v<T> || emulated::is_unbounded_array_v<T>);
 
 	friend GC;
+	template <class> friend class Local;
 
 public:
 	using element_type = std::remove_extent_t<T>;
@@ -121,6 +184,23 @@ public:
 		return *this;
 	}
 
+	// Constructs from a local.
+	template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+	Object(const Local<U>& local)
+		: BaseObject{ static_cast<const BaseLocal&>(local) }
+	{
+		storage_ = static_cast<element_type*>(local.get());
+	}
+
+	// Assigns from a local.
+	template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+	Object& operator=(const Local<U>& rhs)
+	{
+		BaseObject::operator=(static_cast<const BaseLocal&>(rhs));
+		storage_ = static_cast<element_type*>(rhs.get());
+		return *this;
+	}
+
 	// Returns the pointer of storage.
 	element_type* get() const noexcept
 	{
@@ -178,6 +258,144 @@ private:
 	}
 };
 
+class GC::BaseLocal
+{
+	friend BaseObject;
+
+public:
+	BaseLocal() noexcept;
+	explicit BaseLocal(const BaseObject& object);
+	BaseLocal(const BaseLocal& other);
+	BaseLocal(BaseLocal&& other);
+	~BaseLocal();
+	BaseLocal& operator=(const BaseObject& rhs);
+	BaseLocal& operator=(const BaseLocal& rhs);
+	BaseLocal& operator=(BaseLocal&& rhs);
+
+	void reset();
+
+protected:
+	void* storage_;
+
+private:
+	void assign(void* storage, ShadowStack* stack, const void* from);
+
+private:
+	ShadowStack* stack_;
+	std::size_t index_;
+};
+
+// Handle which refers to an object from the stack of a thread, such as arguments and temporaries.
+// It is pushed onto the shadow stack of the thread and scanned on collection, instead of being registered as a root.
+// It must neither be shared with other threads nor outlive the GC, and is cheapest when destructed in reverse order.
+template <class T>
+class GC::Local : protected GC::BaseLocal
+{
+	static_assert((!std::is_array_v<T> && !std::is_void_v<T>) || emulated::is_unbounded_array_v<T>);
+
+	template <class> friend class Object;
+	template <class> friend class Local;
+
+public:
+	using element_type = std::remove_extent_t<T>;
+
+public:
+	Local() noexcept = default;
+	Local(const Local&) = default;
+	Local(Local&&) = default;
+	~Local() = default;
+	Local& operator=(const Local&) = default;
+	Local& operator=(Local&&) = default;
+
+	// Constructs from an object.
+	template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+	Local(const Object<U>& object)
+		: BaseLocal{ static_cast<const BaseObject&>(object) }
+	{
+		storage_ = static_cast<element_type*>(object.get());
+	}
+
+	// Assigns from an object.
+	template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+	Local& operator=(const Object<U>& rhs)
+	{
+		BaseLocal::operator=(static_cast<const BaseObject&>(rhs));
+		storage_ = static_cast<element_type*>(rhs.get());
+		return *this;
+	}
+
+	// Constructs from an other type local.
+	template <class U, class = std::enable_if_t<!std::is_same_v<U, T> && std::is_convertible_v<U*, T*>>>
+	Local(const Local<U>& other)
+		: BaseLocal{ other }
+	{
+		storage_ = static_cast<element_type*>(other.get());
+	}
+
+	// Assigns from an other type local.
+	template <class U, class = std::enable_if_t<!std::is_same_v<U, T> && std::is_convertible_v<U*, T*>>>
+	Local& operator=(const Local<U>& rhs)
+	{
+		BaseLocal::operator=(rhs);
+		storage_ = static_cast<element_type*>(rhs.get());
+		return *this;
+	}
+
+	// Returns the pointer of storage.
+	element_type* get() const noexcept
+	{
+		return static_cast<element_type*>(storage_);
+	}
+
+	// Returns the pointer of storage for accessing members.
+	template <class U = T, class = std::enable_if_t<!std::is_array_v<U> && !std::is_void_v<U>>>
+	U* operator->() const noexcept
+	{
+		return get();
+	}
+
+	// Dereferences the pointer of storage.
+	template <class U = T, class = std::enable_if_t<!std::is_array_v<U> && !std::is_void_v<U>>>
+	U& operator*() const noexcept
+	{
+		return *get();
+	}
+
+	// Returns the reference of nth element of the array in storage.
+	template <class U = T, class = std::enable_if_t<emulated::is_unbounded_array_v<U>>>
+	element_type& operator[](const std::ptrdiff_t index) const noexcept
+	{
+		return get()[index];
+	}
+
+	// Checks if the pointer is not null.
+	explicit operator bool() const noexcept
+	{
+		return get() != nullptr;
+	}
+
+	// Releases the reference.
+	void reset()
+	{
+		BaseLocal::reset();
+	}
+};
+
+// Scope in which small objects allocated by the current thread are placed in a dedicated region.
+// At the end of the scope, the whole region is released at once unless any handle outside of it refers into it.
+// Otherwise, the objects still reachable from outside survive in the normal heap.
+class GC::Region
+{
+public:
+	explicit Region(GC& gc);
+	Region(const Region&) = delete;
+	~Region();
+	Region& operator=(const Region&) = delete;
+
+private:
+	std::shared_ptr<Impl> impl_;
+};
+
 
 template <class T, class... Args>
 std::enable_if_t<!std::is_array_v<T> && !std::is_void_v<T>, GC::Object<T>> GC::new_object(Args&& ...args)
@@ -191,6 +409,22 @@ std::enable_if_t<emulated::is_unbounded_array_v<T>, GC::Object<T>> GC::new_array
 	return { impl_, count };
 }
 
+template <class T>
+bool GC::save_image(std::ostream& stream, const Object<T>& root)
+{
+	using element_type = typename Object<T>::element_type;
+	return save_image(stream, static_cast<const BaseObject&>(root), sizeof(element_type), alignof(element_type), std::is_array_v<T>);
+}
+
+template <class T>
+GC::Object<T> GC::load_image(const char* path)
+{
+	using element_type = typename Object<T>::element_type;
+	Object<T> root;
+	load_image(path, static_cast<BaseObject&>(root), sizeof(element_type), alignof(element_type), std::is_array_v<T>);
+	return root;
+}
+
 
 template <class T>
 template <class U, std::enable_if_t<!std::is_array_v<U> && !std::is_void_v<U>, int>, class... Args>
@@ -198,7 +432,7 @@ GC::Object<T>::Object(const std::shared_ptr<Impl>& impl, Args&&... args)
 	: BaseObject{ impl, sizeof(element_type), alignof(element_type), 0 }
 {
 	storage_ = new (storage_) element_type{ std::forward<Args>(args)... };
-	set_destructor(&destruct, 0);
+	set_destructor(&destruct, 0, is_relocatable_v<element_type>);
 }
 
 template <class T>
@@ -207,7 +441,7 @@ GC::Object<T>::Object(const std::shared_ptr<Impl>& impl, const std::size_t count
 	: BaseObject{ impl, sizeof(element_type), alignof(element_type), count }
 {
 	storage_ = new (storage_) element_type[count] {};
-	set_destructor(&destruct, count);
+	set_destructor(&destruct, count, is_relocatable_v<element_type>);
 }
 
 } // namespace saber
@@ -1,20 +1,51 @@
 ﻿// GC.cpp
 
 #include "saber/GC.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <functional>
+#include <istream>
+#include <limits>
+#include <list>
 #include <map>
 #include <mutex>
+#include <new>
+#include <optional>
+#include <ostream>
+#include <set>
 #include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif // !defined(NOMINMAX)
+#if !defined(WIN32_LEAN_AND_MEAN)
+#define WIN32_LEAN_AND_MEAN
+#endif // !defined(WIN32_LEAN_AND_MEAN)
+#include <windows.h>
+#else // defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // defined(_WIN32)
 
 #if defined(__cpp_exceptions)
 #define SABER_GC_TRY        try
 #define SABER_GC_CATCH_ALL  catch (...)
 #define SABER_GC_RETHROW    throw
+#define SABER_GC_THROW(e)   throw e
 #else // defined(__cpp_exceptions)
 #define SABER_GC_TRY        if constexpr (true)
 #define SABER_GC_CATCH_ALL  if constexpr (false)
 #define SABER_GC_RETHROW    static_cast<void>(0)
+#define SABER_GC_THROW(e)   std::abort()
 #endif // defined(__cpp_exceptions)
 
 #if !defined(SABER_GC_ASSERT)
@@ -25,7 +56,7 @@
 
 namespace saber {
 
-class GC::Impl
+class GC::Impl : public std::enable_shared_from_this<GC::Impl>
 {
 public:
 	Impl(std::pmr::memory_resource* resource);
@@ -35,14 +66,40 @@ public:
 
 	//	from GC
 	void collect();
+	void set_large_object_threshold(const std::size_t bytes) noexcept;
+	void set_soft_heap_limit(const std::size_t bytes) noexcept;
+	void set_hard_heap_limit(const std::size_t bytes) noexcept;
+	void set_heap_retention(const std::size_t bytes) noexcept;
+	std::size_t get_heap_bytes() const noexcept;
+	void set_reference_counting(const bool enabled);
+	void start_trace(std::ostream& stream);
+	bool stop_trace();
+	static std::optional<std::chrono::nanoseconds> replay_trace(GC& gc, std::istream& stream);
+	bool save_image(std::ostream& stream, const BaseObject* root, const std::size_t size, const std::size_t alignment, const bool is_array);
+	void load_image(const char* path, BaseObject* root, const std::size_t size, const std::size_t alignment, const bool is_array);
+
+	//	from Region
+	void enter_region();
+	void leave_region();
+
+	//	from Local
+	ShadowStack& get_shadow_stack();
+	void trace_copy_local(const BaseLocal* to, const void* from, const bool overwrite);
+	void trace_remove_local(const BaseLocal* local);
 
 	//	functions without lock
 	std::pair<void*, bool> new_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count);
-	void set_destructor(const void* storage, void(*destructor)(void*, const std::size_t));
+	void set_destructor(const void* storage, void(*destructor)(void*, const std::size_t), const bool is_relocatable);
+	void reclaim_storages();
+
+	//	from Storage and Chunk
+	void reserve_heap(const std::size_t bytes);
+	void release_heap(const std::size_t bytes) noexcept;
 
 	//	functions with lock
 	std::unique_lock<std::mutex> lock();
 	bool copy_object(const BaseObject* to, const BaseObject* from, const bool overwrite, const std::unique_lock<std::mutex>& locker);
+	bool copy_local(const BaseObject* to, const BaseLocal* from, const void* storage, const std::unique_lock<std::mutex>& locker);
 	void remove_object(const BaseObject* object, const std::unique_lock<std::mutex>& locker);
 	void mark_child_object(const BaseObject* object, const std::unique_lock<std::mutex>& locker);
 
@@ -51,17 +108,121 @@ private:
 	using storage_container_type = std::pmr::map<const void*, Storage, std::greater<>>;
 	using storage_iterator_type = typename storage_container_type::iterator;
 
-	using object_container_type = std::pmr::unordered_map<const BaseObject*, storage_iterator_type>;
+	// Storages are referred by pointers, which are kept valid while they are moved between containers as nodes.
+	using object_container_type = std::pmr::unordered_map<const BaseObject*, Storage*>;
+	using object_iterator_type = typename object_container_type::iterator;
+
+	class Pages;
+
+	class Chunk;
+	using chunk_container_type = std::pmr::map<const void*, Chunk, std::greater<>>;
+
+	class Arena;
+	using arena_container_type = std::pmr::list<Arena>;
+
+	class ThreadBuffer;
+	using buffer_container_type = std::pmr::list<ThreadBuffer>;
+
+	class ThreadCache;
+
+	enum TraceTag : unsigned char;
+	class TraceWriter;
+	class TraceReader;
+	class Replayer;
+
+	struct ImageHeader;
+	struct ImageStorage;
+	struct ImageChild;
+
+	// Lifetime of Impl shared with thread caches, which may outlive Impl.
+	struct Lifetime
+	{
+		std::mutex mutex;
+		std::atomic<Impl*> impl;
+	};
+
+	// Size of a chunk from which small objects are bump-allocated by a thread.
+	static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+	// Objects larger than this are allocated separately with lock.
+	static constexpr std::size_t CHUNK_OBJECT_SIZE_LIMIT = CHUNK_SIZE / 8;
+	// Chunks still in use are recycled once this many bytes in them are freed since they are last allocated from.
+	static constexpr std::size_t CHUNK_RECYCLING_BYTES = CHUNK_SIZE / 4;
+	// Objects not smaller than this are mapped directly from the OS by default.
+	static constexpr std::size_t DEFAULT_LARGE_OBJECT_THRESHOLD = 1024 * 1024;
+	// No limits of the heap by default.
+	static constexpr std::size_t NO_HEAP_LIMIT = std::numeric_limits<std::size_t>::max();
+	// Version of heap images, which is bumped whenever the format changes.
+	static constexpr std::uint32_t IMAGE_VERSION = 2;
 
 private:
-	bool add_object(const BaseObject* object, storage_iterator_type iterator, const bool overwrite, const std::unique_lock<std::mutex>& locker);
+	//	functions without lock
+	ThreadBuffer* get_thread_buffer();
+	ThreadBuffer* find_thread_buffer() const noexcept;
+	void remove_thread_buffer(ThreadBuffer* buffer);
+
+	static ThreadCache& get_thread_cache();
+
+	std::pair<void*, bool> allocate_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count);
+	static std::size_t& get_destruction_depth();
+
+	//	functions with lock
+	bool add_object(const BaseObject* object, Storage* storage, const bool overwrite, const std::unique_lock<std::mutex>& locker);
+	bool register_object(const BaseObject* object, Storage* storage, Storage* parent, const bool overwrite, const std::unique_lock<std::mutex>& locker);
+	std::pair<object_container_type*, object_iterator_type> find_object(const BaseObject* object, const std::unique_lock<std::mutex>& locker);
+	void detach_children(const Storage& storage, const std::unique_lock<std::mutex>& locker);
+	void release_storage(Storage* storage, const std::unique_lock<std::mutex>& locker);
+	bool is_counted(const Storage& storage, const std::unique_lock<std::mutex>& locker) const noexcept;
+	Storage* find_storage(const void* address, const std::unique_lock<std::mutex>& locker);
+	std::pair<storage_container_type*, storage_iterator_type> find_published_storage(const void* address, const std::unique_lock<std::mutex>& locker);
+	template <class Function>
+	void for_each_storage_container(Function function, const std::unique_lock<std::mutex>& locker);
+	template <class Function>
+	void for_each_local_storage(Function function, const std::unique_lock<std::mutex>& locker);
+	void publish_thread_buffers(const std::unique_lock<std::mutex>& locker);
+	bool try_reserve_heap(const std::size_t bytes) noexcept;
+	void retire_chunk(Chunk* chunk, std::pmr::deque<Chunk>& erased_chunks, const std::unique_lock<std::mutex>& locker);
+	void release_arena(Arena& arena, std::pmr::deque<Chunk>& erased_chunks, const std::unique_lock<std::mutex>& locker);
+	void destruct_storages(std::pmr::deque<Storage>& erased_storages, std::pmr::deque<Chunk>& erased_chunks, std::unique_lock<std::mutex>& locker);
+	void collect_in_emergency();
+	void trim_free_chunks(const std::size_t retention, std::pmr::deque<Chunk>& erased_chunks, const std::unique_lock<std::mutex>& locker);
+	std::pair<const void*, std::size_t> find_trace_location(const BaseObject* object, const bool is_root_object, const std::unique_lock<std::mutex>& locker);
 
 private:
 	std::pmr::memory_resource* resource_;
 
+	// Bytes allocated from the memory resource or the OS, including free chunks.
+	std::atomic<std::size_t> heap_bytes_{ 0 };
+	std::atomic<std::size_t> soft_heap_limit_{ NO_HEAP_LIMIT };
+	std::atomic<std::size_t> hard_heap_limit_{ NO_HEAP_LIMIT };
+	std::atomic<std::size_t> heap_retention_{ 0 };
+	// Heap bytes at which the next collection is triggered over the soft limit.
+	std::atomic<std::size_t> collection_trigger_{ NO_HEAP_LIMIT };
+
+	chunk_container_type chunks_;
+	// Chunks retained for reuse after their storages are all collected.
+	std::pmr::deque<Chunk> free_chunks_;
+	// Chunks still in use, whose free ranges are allocated from by the next thread refilling its buffer.
+	std::pmr::set<Chunk*> recyclable_chunks_;
 	storage_container_type storages_;
+	// Large objects are kept apart from small ones so that they are swept separately.
+	storage_container_type large_storages_;
+	std::atomic<std::size_t> large_object_threshold_{ DEFAULT_LARGE_OBJECT_THRESHOLD };
 	object_container_type root_objects_;
 	object_container_type child_objects_;
+	buffer_container_type buffers_;
+	// Storages whose reference count has dropped to zero, which are reclaimed without tracing.
+	std::pmr::vector<const void*> zero_count_storages_;
+	std::atomic<bool> is_reference_counting_{ false };
+	std::atomic<bool> has_zero_count_storages_{ false };
+	std::shared_ptr<Lifetime> lifetime_;
+
+	// Number of destruct_storages() running, whose end is notified to emergency collections.
+	std::size_t destructing_count_{ 0 };
+	std::condition_variable destructed_;
+
+	// Trace written while tracing, which is checked without lock on allocation.
+	std::unique_ptr<TraceWriter> trace_;
+	std::atomic<bool> is_tracing_{ false };
 
 	std::mutex mutex_;
 };
@@ -69,7 +230,8 @@ private:
 class GC::Impl::Storage
 {
 public:
-	Storage(const std::size_t size, const std::size_t alignment, const std::size_t count, Impl* impl);
+	Storage(const std::size_t size, const std::size_t alignment, const std::size_t count, const bool is_mapped, Impl* impl);
+	Storage(void* pointer, const std::size_t size, const std::size_t alignment, const std::size_t count, Chunk* chunk, Impl* impl) noexcept;
 	Storage(Storage&& other) noexcept;
 	~Storage();
 	Storage& operator=(const Storage&) = delete;
@@ -77,10 +239,24 @@ public:
 	//	functions without lock of Impl
 	void* get_pointer() const noexcept;
 	std::size_t get_bytes() const noexcept;
+	std::size_t get_alignment() const noexcept;
+	Chunk* get_chunk() const noexcept;
+	std::size_t get_heap_bytes() const noexcept;
+	void destruct();
 
 	//	functions with lock of Impl
-	void set_destructor(void(*destructor)(void*, const std::size_t), const std::unique_lock<std::mutex>& locker) noexcept;
+	Arena* get_arena(const std::unique_lock<std::mutex>& locker) const noexcept;
+	void set_destructor(void(*destructor)(void*, const std::size_t), const bool is_relocatable, const std::unique_lock<std::mutex>& locker) noexcept;
+	bool is_relocatable(const std::unique_lock<std::mutex>& locker) const noexcept;
+	void set_relocated(const std::unique_lock<std::mutex>& locker) noexcept;
 	void add_child(const BaseObject* object, const std::unique_lock<std::mutex>& locker);
+	const std::pmr::vector<const BaseObject*>& get_children(const std::unique_lock<std::mutex>& locker) const noexcept;
+	const std::pmr::vector<const BaseObject*>& get_unique_children(const std::unique_lock<std::mutex>& locker);
+	void add_reference(const std::unique_lock<std::mutex>& locker) noexcept;
+	bool release_reference(const std::unique_lock<std::mutex>& locker) noexcept;
+	void reset_references(const std::unique_lock<std::mutex>& locker) noexcept;
+	bool is_referenced(const std::unique_lock<std::mutex>& locker) const noexcept;
+	std::size_t get_reference_count(const std::unique_lock<std::mutex>& locker) const noexcept;
 	bool is_marked(const std::unique_lock<std::mutex>& locker) const noexcept;
 	void mark(const std::unique_lock<std::mutex>& locker);
 	void unmark(const std::unique_lock<std::mutex>& locker) noexcept;
@@ -91,12 +267,395 @@ private:
 	std::size_t alignment_;
 	std::size_t count_;
 	void (*destructor_)(void*, const std::size_t){ nullptr };
+	Chunk* chunk_{ nullptr };
+	bool is_mapped_{ false };
+	bool is_relocatable_{ false };
+	// Relocated from an image without constructing, which is destructed by destructing its children.
+	bool is_relocated_{ false };
 	Impl* impl_;
 
-	std::pmr::deque<const BaseObject*> child_objects_;
+	std::pmr::vector<const BaseObject*> child_objects_;
+	// Number of objects referring to this storage, including children of other storages.
+	std::size_t reference_count_{ 0 };
 	bool is_marked_{ true };
 };
 
+// Pages mapped directly from the OS for large objects.
+class GC::Impl::Pages
+{
+public:
+	Pages() = delete;
+
+	static std::size_t get_size() noexcept;
+	static std::size_t round_up(const std::size_t bytes) noexcept;
+	static void* map(const std::size_t bytes) noexcept;
+	static void unmap(void* pointer, const std::size_t bytes) noexcept;
+	static void* map_file(const char* path, std::size_t& bytes) noexcept;
+	static void unmap_file(void* pointer, const std::size_t bytes) noexcept;
+};
+
+class GC::Impl::Chunk
+{
+public:
+	Chunk(const std::size_t bytes, Impl* impl);
+	Chunk(void* pointer, const std::size_t bytes, Impl* impl);
+	Chunk(Chunk&& other) noexcept;
+	~Chunk();
+	Chunk& operator=(const Chunk&) = delete;
+
+	//	functions without lock of Impl
+	void* get_pointer() const noexcept;
+	std::size_t get_bytes() const noexcept;
+	bool contains(const void* address) const noexcept;
+	bool is_mapped() const noexcept;
+
+	//	functions only for the owner thread
+	void* allocate(const std::size_t bytes, const std::size_t alignment) noexcept;
+
+	//	functions with lock of Impl
+	ThreadBuffer* get_owner(const std::unique_lock<std::mutex>& locker) const noexcept;
+	void set_owner(ThreadBuffer* owner, const std::unique_lock<std::mutex>& locker) noexcept;
+	Arena* get_arena(const std::unique_lock<std::mutex>& locker) const noexcept;
+	void set_arena(Arena* arena, const std::unique_lock<std::mutex>& locker) noexcept;
+	void add_storage(const std::unique_lock<std::mutex>& locker) noexcept;
+	bool remove_storage(const void* pointer, const std::size_t bytes, const std::unique_lock<std::mutex>& locker);
+	bool is_unused(const std::unique_lock<std::mutex>& locker) const noexcept;
+	bool is_recyclable(const std::unique_lock<std::mutex>& locker) const noexcept;
+	void reset(const std::unique_lock<std::mutex>& locker) noexcept;
+
+private:
+	// Free ranges are keyed by their ends, so that they are allocated from their beginnings in place.
+	using range_container_type = std::pmr::map<std::size_t, std::size_t>;
+
+	void* allocate(std::size_t& begin, const std::size_t end, const std::size_t bytes, const std::size_t alignment) noexcept;
+	void coalesce(range_container_type::iterator range) noexcept;
+
+private:
+	std::byte* pointer_;
+	std::size_t bytes_;
+	// Beginning of the rest of the chunk never allocated from, which is bump-allocated after free ranges.
+	std::size_t top_{ 0 };
+	// Free ranges handed over to the owner, and the one being allocated from.
+	range_container_type owned_ranges_;
+	range_container_type::iterator owned_range_;
+	// Mapped from an image file.
+	bool is_mapped_{ false };
+	Impl* impl_;
+
+	ThreadBuffer* owner_{ nullptr };
+	Arena* arena_{ nullptr };
+	std::size_t storage_count_{ 0 };
+	// Ranges of storages destructed since the chunk is last handed over, and the bytes of them.
+	range_container_type free_ranges_;
+	std::size_t freed_bytes_{ 0 };
+};
+
+// Chunks allocated by a thread while it is in a region, and storages in them.
+// Storages are kept apart from the heap until leaving the region, when only the ones still referred are moved into it.
+class GC::Impl::Arena
+{
+public:
+	explicit Arena(Impl* impl);
+	Arena(const Arena&) = delete;
+	~Arena() = default;
+	Arena& operator=(const Arena&) = delete;
+
+	//	functions only for the owner thread
+	Chunk* get_chunk() const noexcept;
+	void add_chunk(Chunk* chunk);
+
+	//	functions with lock of Impl
+	const std::pmr::vector<Chunk*>& get_chunks(const std::unique_lock<std::mutex>& locker) const noexcept;
+	storage_container_type& get_storages(const std::unique_lock<std::mutex>& locker) noexcept;
+
+private:
+	Impl* impl_;
+
+	std::pmr::vector<Chunk*> chunks_;
+	storage_container_type storages_;
+};
+
+// Stack of storages referred by locals of a thread, which is pushed and popped by the thread without lock.
+// Slots below the top are never rewritten while they are in use, so that collection scanning it concurrently
+// sees every storage referred by locals, which may be only copied between slots in the meantime.
+// Slots popped out of order are kept as they are until the slots above them are popped.
+class GC::ShadowStack
+{
+public:
+	ShadowStack(Impl* impl, std::pmr::memory_resource* resource);
+	ShadowStack(const ShadowStack&) = delete;
+	~ShadowStack() = default;
+	ShadowStack& operator=(const ShadowStack&) = delete;
+
+	//	functions only for the owner thread without lock of Impl
+	Impl* get_impl() const noexcept;
+	std::size_t push(const void* storage);
+	void set(const std::size_t index, const void* storage);
+	void pop(const std::size_t index) noexcept;
+
+	//	functions with lock of Impl
+	template <class Function>
+	void for_each(Function function);
+
+private:
+	struct Slot
+	{
+		std::atomic<const void*> storage;
+		bool is_popped;
+	};
+
+private:
+	Impl* impl_;
+
+	std::pmr::deque<Slot> slots_;
+	std::atomic<std::size_t> size_{ 0 };
+	// Locked only to grow the slots or to rewrite a slot below the top, and while scanning.
+	std::mutex mutex_;
+};
+
+// Per-thread allocation buffer.
+// Objects are bump-allocated from the chunk of the buffer and kept pending here without any lock.
+// Pending objects are published to Impl when the chunk is refilled, on collection, or when they are looked up.
+class GC::Impl::ThreadBuffer
+{
+public:
+	explicit ThreadBuffer(Impl* impl);
+	ThreadBuffer(const ThreadBuffer&) = delete;
+	~ThreadBuffer() = default;
+	ThreadBuffer& operator=(const ThreadBuffer&) = delete;
+
+	//	functions only for the owner thread without lock of Impl
+	std::pair<void*, bool> new_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count);
+	bool set_destructor(const void* storage, void(*destructor)(void*, const std::size_t), const bool is_relocatable) noexcept;
+	void begin_construction(const BaseObject* object, const void* storage, const std::size_t bytes);
+	void abandon_construction(const BaseObject* object) noexcept;
+	Chunk* get_chunk() const noexcept;
+	void set_chunk(Chunk* chunk);
+	Arena* get_arena() noexcept;
+	ShadowStack& get_shadow_stack() noexcept;
+	bool is_reclaiming() const noexcept;
+	void set_reclaiming(const bool reclaiming) noexcept;
+
+	//	functions with lock of Impl
+	void publish(const std::unique_lock<std::mutex>& locker);
+	arena_container_type& get_arenas(const std::unique_lock<std::mutex>& locker) noexcept;
+	void push_arena(const std::unique_lock<std::mutex>& locker);
+	void pop_arena(const std::unique_lock<std::mutex>& locker) noexcept;
+
+private:
+	// Pending storage is handed over to a publisher once constructed, or taken by it while constructing.
+	enum PendingState : unsigned char
+	{
+		PENDING_CONSTRUCTING,
+		PENDING_CONSTRUCTED,
+		PENDING_PUBLISHED,
+	};
+
+	// Storage allocated by the owner thread, and the object referring to it.
+	struct PendingStorage
+	{
+		std::optional<Storage> storage;
+		const BaseObject* object{ nullptr };
+		const void* parent{ nullptr };
+		void (*destructor)(void*, const std::size_t){ nullptr };
+		bool is_relocatable{ false };
+		std::atomic<PendingState> state{ PENDING_CONSTRUCTING };
+	};
+
+	// Object whose storage is being constructed by the owner thread.
+	// Objects created inside it while constructing are children, not roots.
+	struct Construction
+	{
+		const BaseObject* object;
+		const void* storage;
+		std::size_t bytes;
+		std::size_t index;
+		std::size_t generation;
+	};
+
+	static constexpr std::size_t NOT_PENDING = static_cast<std::size_t>(-1);
+
+private:
+	Impl* impl_;
+	Chunk* chunk_{ nullptr };
+	arena_container_type arenas_;
+
+	// Slots are filled by the owner thread without lock and published up to the size by others with the mutex.
+	// The owner thread grows or rewinds them only with the mutex, so that publishers never see them moving.
+	std::pmr::deque<PendingStorage> storages_;
+	std::atomic<std::size_t> size_{ 0 };
+	std::atomic<std::size_t> published_size_{ 0 };
+	// Incremented whenever the slots are rewound, which invalidates indices of constructions.
+	std::size_t generation_{ 0 };
+	std::mutex mutex_;
+
+	std::pmr::vector<Construction> constructions_;
+	ShadowStack shadow_stack_;
+	bool is_reclaiming_{ false };
+};
+
+// Thread-local cache of buffers for each GC instance used by the thread.
+class GC::Impl::ThreadCache
+{
+public:
+	ThreadCache() = default;
+	ThreadCache(const ThreadCache&) = delete;
+	~ThreadCache();
+	ThreadCache& operator=(const ThreadCache&) = delete;
+
+	ThreadBuffer* find(const Impl* impl) const noexcept;
+	void insert(std::shared_ptr<Lifetime> lifetime, ThreadBuffer* buffer);
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<Lifetime> lifetime;
+		ThreadBuffer* buffer;
+	};
+
+private:
+	std::vector<Entry> entries_;
+};
+
+// Binary trace of object operations and collections.
+// It begins with the magic and the version, and each record is a tag followed by fields encoded in unsigned LEB128.
+// Objects and storages are identified by their addresses, and children by the storage and the offset in it.
+// Locals are recorded as root objects, so that they keep their storages alive on replay.
+enum GC::Impl::TraceTag : unsigned char
+{
+	TRACE_NEW_OBJECT = 1,		// object, storage, size, alignment, count, parent storage (0 if root), offset
+	TRACE_COPY_OBJECT,			// to, from, overwrite, parent storage (0 if root), offset
+	TRACE_REMOVE_OBJECT,		// object
+	TRACE_COLLECT,				//
+};
+
+class GC::Impl::TraceWriter
+{
+public:
+	explicit TraceWriter(std::ostream& stream);
+	TraceWriter(const TraceWriter&) = delete;
+	~TraceWriter();
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	void write_new_object(const BaseObject* object, const void* storage, const std::size_t size, const std::size_t alignment, const std::size_t count, const std::pair<const void*, std::size_t>& location);
+	void write_copy_object(const void* to, const void* from, const bool overwrite, const std::pair<const void*, std::size_t>& location);
+	void write_remove_object(const void* object);
+	void write_collect();
+	bool flush();
+
+private:
+	void write(const std::uintmax_t value);
+	void write(const void* address);
+
+private:
+	std::ostream& stream_;
+};
+
+class GC::Impl::TraceReader
+{
+public:
+	struct Record
+	{
+		TraceTag tag;
+		std::uintmax_t object;
+		std::uintmax_t from;
+		std::uintmax_t storage;
+		std::uintmax_t size;
+		std::uintmax_t alignment;
+		std::uintmax_t count;
+		std::uintmax_t overwrite;
+		std::uintmax_t parent;
+		std::uintmax_t offset;
+	};
+
+public:
+	explicit TraceReader(std::istream& stream);
+	TraceReader(const TraceReader&) = delete;
+	~TraceReader() = default;
+	TraceReader& operator=(const TraceReader&) = delete;
+
+	bool is_valid() const noexcept;
+	bool read(Record& record);
+
+private:
+	bool read(std::uintmax_t& value);
+
+private:
+	std::istream& stream_;
+	bool is_valid_{ false };
+};
+
+// Re-executes a trace with storages made of handles, so that the same graph of objects is built.
+class GC::Impl::Replayer
+{
+public:
+	explicit Replayer(GC& gc);
+	Replayer(const Replayer&) = delete;
+	~Replayer() = default;
+	Replayer& operator=(const Replayer&) = delete;
+
+	std::optional<std::chrono::nanoseconds> replay(std::istream& stream);
+
+private:
+	struct Cell
+	{
+		Object<Cell[]> object;
+	};
+
+private:
+	bool new_object(const TraceReader::Record& record);
+	bool copy_object(const TraceReader::Record& record);
+	void remove_object(const TraceReader::Record& record);
+	Object<Cell[]>* find_object(const std::uintmax_t object) const;
+	std::optional<Cell*> find_cell(const std::uintmax_t parent, const std::uintmax_t offset) const;
+	Object<Cell[]>& emplace_object(const std::uintmax_t object, Cell* cell);
+
+private:
+	GC& gc_;
+
+	// Handles which are roots are allocated separately, and children are cells in storages.
+	std::unordered_map<std::uintmax_t, std::unique_ptr<Object<Cell[]>>> root_objects_;
+	std::unordered_map<std::uintmax_t, Object<Cell[]>*> child_objects_;
+	// Cells of each storage along with their count.
+	std::unordered_map<std::uintmax_t, std::pair<Cell*, std::size_t>> storages_;
+};
+
+// Heap image, which is the header followed by the tables of storages and children, and the data mapped back as a chunk.
+// Storages are placed in the data with their alignments, and handles in them are zeroed since they are relocated from the table.
+struct GC::Impl::ImageHeader
+{
+	char magic[4];
+	std::uint32_t version;
+	std::uint64_t pointer_size;
+	std::uint64_t object_size;
+	std::uint64_t storage_count;
+	std::uint64_t child_count;
+	std::uint64_t data_offset;
+	std::uint64_t data_bytes;
+	std::uint64_t root_storage;
+	std::uint64_t root_offset;
+	std::uint64_t root_count;
+	std::uint64_t root_size;		// of the element type
+	std::uint64_t root_alignment;
+	std::uint64_t root_is_array;
+};
+
+struct GC::Impl::ImageStorage
+{
+	std::uint64_t offset;		// in the data
+	std::uint64_t bytes;
+	std::uint64_t alignment;
+};
+
+struct GC::Impl::ImageChild
+{
+	std::uint64_t parent;		// index of the storage in which the handle is
+	std::uint64_t offset;		// in the parent
+	std::uint64_t storage;		// index of the storage to which the handle refers
+	std::uint64_t storage_offset;
+	std::uint64_t count;
+};
+
 
 GC::GC(std::pmr::memory_resource* resource)
 {
@@ -107,253 +666,2596 @@ GC::GC(std::pmr::memory_resource* resource)
 	impl_ = std::allocate_shared<Impl>(std::pmr::polymorphic_allocator<Impl>{ resource }, resource);
 }
 
-GC::GC(GC&&) noexcept = default;
+GC::GC(GC&&) noexcept = default;
+
+GC::~GC() = default;
+
+GC& GC::operator=(GC&&) noexcept = default;
+
+void GC::collect()
+{
+	impl_->collect();
+}
+
+void GC::set_large_object_threshold(const std::size_t bytes) noexcept
+{
+	impl_->set_large_object_threshold(bytes);
+}
+
+void GC::set_soft_heap_limit(const std::size_t bytes) noexcept
+{
+	impl_->set_soft_heap_limit(bytes);
+}
+
+void GC::set_hard_heap_limit(const std::size_t bytes) noexcept
+{
+	impl_->set_hard_heap_limit(bytes);
+}
+
+void GC::set_heap_retention(const std::size_t bytes) noexcept
+{
+	impl_->set_heap_retention(bytes);
+}
+
+std::size_t GC::get_heap_bytes() const noexcept
+{
+	return impl_->get_heap_bytes();
+}
+
+void GC::set_reference_counting(const bool enabled)
+{
+	impl_->set_reference_counting(enabled);
+}
+
+void GC::start_trace(std::ostream& stream)
+{
+	impl_->start_trace(stream);
+}
+
+bool GC::stop_trace()
+{
+	return impl_->stop_trace();
+}
+
+std::optional<std::chrono::nanoseconds> GC::replay_trace(std::istream& stream)
+{
+	return Impl::replay_trace(*this, stream);
+}
+
+bool GC::save_image(std::ostream& stream, const BaseObject& root, const std::size_t size, const std::size_t alignment, const bool is_array)
+{
+	return impl_->save_image(stream, &root, size, alignment, is_array);
+}
+
+void GC::load_image(const char* path, BaseObject& root, const std::size_t size, const std::size_t alignment, const bool is_array)
+{
+	impl_->load_image(path, &root, size, alignment, is_array);
+}
+
+
+GC::Region::Region(GC& gc)
+	: impl_{ gc.impl_ }
+{
+	SABER_GC_ASSERT(impl_);
+	impl_->enter_region();
+}
+
+GC::Region::~Region()
+{
+	impl_->leave_region();
+}
+
+
+GC::Impl::Impl(std::pmr::memory_resource* resource)
+	: resource_{ resource }
+	, chunks_{ resource }
+	, free_chunks_{ resource }
+	, recyclable_chunks_{ resource }
+	, storages_{ resource }
+	, large_storages_{ resource }
+	, root_objects_{ resource }
+	, child_objects_{ resource }
+	, buffers_{ resource }
+	, zero_count_storages_{ resource }
+	, lifetime_{ std::make_shared<Lifetime>() }
+{
+	lifetime_->impl = this;
+}
+
+GC::Impl::~Impl()
+{
+	// There must be no root objects because they have a shared_ptr<Impl>.
+	SABER_GC_ASSERT(root_objects_.size() == 0);
+
+	// Waits for threads exiting with their buffers.
+	{
+		std::lock_guard<std::mutex> lifetime_locker{ lifetime_->mutex };
+		lifetime_->impl = nullptr;
+	}
+
+	// Pending storages are destructed along with the others.
+	auto locker = lock();
+	publish_thread_buffers(locker);
+}
+
+void GC::Impl::collect()
+{
+	// Moving erasing containers to this container prevents the mutex from being double-locked.
+	// Chunks are deallocated after all of storages in them are destructed.
+	std::pmr::deque<Chunk> erased_chunks{ resource_ };
+	std::pmr::deque<Storage> erased_storages{ resource_ };
+
+	// Collections are serialized by the lock only while marking, sweeping, and trimming.
+	auto locker = lock();
+
+	if (trace_) {
+		trace_->write_collect();
+	}
+
+	// Publishing objects allocated by threads.
+	publish_thread_buffers(locker);
+
+	// Storages queued by reference counting are swept unless they are still referred by locals.
+	zero_count_storages_.clear();
+	has_zero_count_storages_ = false;
+
+	// Preparing.
+	// Storages in regions are collected likewise.
+	for_each_storage_container([&locker](auto&& storages) {
+		for (auto&& storage : storages) {
+			storage.second.unmark(locker);
+		}
+	}, locker);
+
+	// Mark phase.
+	for (auto&& object : root_objects_) {
+		object.second->mark(locker);
+	}
+	for_each_local_storage([&locker](auto storage) {
+		storage->mark(locker);
+	}, locker);
+
+	// Sweep phase.
+	// Children are detached from all of unmarked storages before erasing any of them, since they may refer to each other.
+	for_each_storage_container([this, &locker](auto&& storages) {
+		for (auto&& storage : storages) {
+			if (!storage.second.is_marked(locker)) {
+				detach_children(storage.second, locker);
+			}
+		}
+	}, locker);
+	for_each_storage_container([&erased_storages, &locker](auto&& storages) {
+		for (auto it = storages.begin(); it != storages.end();) {
+			if (it->second.is_marked(locker)) {
+				++it;
+			} else {
+				erased_storages.push_back(std::move(it->second));
+				it = storages.erase(it);
+			}
+		}
+	}, locker);
+
+	// Free memory beyond the retention is returned.
+	trim_free_chunks(heap_retention_, erased_chunks, locker);
+
+	destruct_storages(erased_storages, erased_chunks, locker);
+	locker.unlock();
+
+	// Collects again after the heap grows by a fraction of the soft limit while over it.
+	auto soft_heap_limit = soft_heap_limit_.load();
+	if (soft_heap_limit != NO_HEAP_LIMIT) {
+		collection_trigger_ = std::max(soft_heap_limit, heap_bytes_ + soft_heap_limit / 8);
+	}
+}
+
+void GC::Impl::set_large_object_threshold(const std::size_t bytes) noexcept
+{
+	large_object_threshold_ = bytes;
+}
+
+void GC::Impl::set_soft_heap_limit(const std::size_t bytes) noexcept
+{
+	soft_heap_limit_ = bytes;
+	collection_trigger_ = bytes;
+}
+
+void GC::Impl::set_hard_heap_limit(const std::size_t bytes) noexcept
+{
+	hard_heap_limit_ = bytes;
+}
+
+void GC::Impl::set_heap_retention(const std::size_t bytes) noexcept
+{
+	heap_retention_ = bytes;
+}
+
+std::size_t GC::Impl::get_heap_bytes() const noexcept
+{
+	return heap_bytes_;
+}
+
+void GC::Impl::set_reference_counting(const bool enabled)
+{
+	auto locker = lock();
+
+	if (enabled == is_reference_counting_) {
+		return;
+	}
+	is_reference_counting_ = enabled;
+	zero_count_storages_.clear();
+	has_zero_count_storages_ = false;
+
+	// References are not counted while disabled, except in regions, so that they are counted again from the objects.
+	if (enabled) {
+		for_each_storage_container([&locker](auto&& storages) {
+			for (auto&& storage : storages) {
+				storage.second.reset_references(locker);
+			}
+		}, locker);
+		for (auto&& objects : { &root_objects_, &child_objects_ }) {
+			for (auto&& object : *objects) {
+				if (object.second) {
+					object.second->add_reference(locker);
+				}
+			}
+		}
+	}
+}
+
+void GC::Impl::start_trace(std::ostream& stream)
+{
+	auto trace = std::make_unique<TraceWriter>(stream);
+
+	auto locker = lock();
+
+	trace_ = std::move(trace);
+	is_tracing_ = true;
+}
+
+bool GC::Impl::stop_trace()
+{
+	std::unique_ptr<TraceWriter> trace;
+	{
+		auto locker = lock();
+
+		trace = std::move(trace_);
+		is_tracing_ = false;
+	}
+
+	return !trace || trace->flush();
+}
+
+std::optional<std::chrono::nanoseconds> GC::Impl::replay_trace(GC& gc, std::istream& stream)
+{
+	Replayer replayer{ gc };
+	return replayer.replay(stream);
+}
+
+bool GC::Impl::save_image(std::ostream& stream, const BaseObject* root, const std::size_t root_size, const std::size_t root_alignment, const bool root_is_array)
+{
+	SABER_GC_ASSERT(root);
+
+	std::pmr::vector<Storage*> storages{ resource_ };
+	std::pmr::unordered_map<const void*, std::size_t> indices{ resource_ };
+	std::pmr::vector<ImageStorage> image_storages{ resource_ };
+	std::pmr::vector<ImageChild> image_children{ resource_ };
+	std::pmr::vector<std::byte> image_data{ resource_ };
+	ImageHeader header{ { 'S', 'G', 'C', 'I' }, IMAGE_VERSION, sizeof(void*), sizeof(BaseObject), 0, 0, 0, 0, 0, 0, 0, root_size, root_alignment, root_is_array };
+
+	// Storages are copied under the lock, and written after releasing it so that slow streams do not block other threads.
+	{
+		auto locker = lock();
+
+		publish_thread_buffers(locker);
+
+		auto index_of = [&storages, &indices](Storage* storage) {
+			auto emplaced = indices.emplace(storage->get_pointer(), storages.size());
+			if (emplaced.second) {
+				storages.push_back(storage);
+			}
+			return emplaced.first->second;
+		};
+		auto offset_in = [](Storage* storage, const void* address) {
+			return static_cast<std::uint64_t>(static_cast<const std::byte*>(address) - static_cast<const std::byte*>(storage->get_pointer()));
+		};
+
+		if (root->storage_) {
+			auto found = find_object(root, locker);
+			SABER_GC_ASSERT(found.first);
+
+			header.root_storage = index_of(found.second->second);
+			header.root_offset = offset_in(found.second->second, root->storage_);
+			header.root_count = root->count_;
+		}
+
+		// Storages reachable from the root are numbered in breadth-first order, and their children are listed in order of addresses.
+		for (std::size_t i = 0; i < storages.size(); ++i) {
+			auto&& storage = *storages[i];
+			if (!storage.is_relocatable(locker)) {
+				return false;
+			}
+
+			for (auto&& child_object : storage.get_unique_children(locker)) {
+				auto found = child_objects_.find(child_object);
+				if (found == child_objects_.end() || !found->second || !child_object->storage_) {
+					continue;
+				}
+
+				auto offset = offset_in(storages[i], child_object);
+				auto index = index_of(found->second);
+				image_children.push_back({ i, offset, index, offset_in(found->second, child_object->storage_), child_object->count_ });
+			}
+		}
+
+		auto round_up = [](const std::uint64_t value, const std::uint64_t alignment) {
+			return (value + alignment - 1) / alignment * alignment;
+		};
+
+		// The data is mapped at a page boundary, which is aligned enough for any storage up to the page size.
+		std::uint64_t data_alignment = alignof(std::max_align_t);
+		for (auto&& storage : storages) {
+			auto alignment = storage->get_alignment();
+			if (alignment > Pages::get_size()) {
+				return false;
+			}
+			data_alignment = std::max<std::uint64_t>(data_alignment, alignment);
+
+			header.data_bytes = round_up(header.data_bytes, alignment);
+			image_storages.push_back({ header.data_bytes, storage->get_bytes(), alignment });
+			header.data_bytes += storage->get_bytes();
+		}
+
+		header.storage_count = image_storages.size();
+		header.child_count = image_children.size();
+		header.data_offset = round_up(sizeof(ImageHeader) + sizeof(ImageStorage) * image_storages.size() + sizeof(ImageChild) * image_children.size(), data_alignment);
+
+		image_data.resize(static_cast<std::size_t>(header.data_bytes));
+		auto child = image_children.begin();
+		for (std::size_t i = 0; i < storages.size(); ++i) {
+			auto begin = static_cast<const std::byte*>(storages[i]->get_pointer());
+			auto copied = image_data.data() + image_storages[i].offset;
+			std::memcpy(copied, begin, static_cast<std::size_t>(image_storages[i].bytes));
+			for (; child != image_children.end() && child->parent == i; ++child) {
+				std::memset(copied + child->offset, 0, sizeof(BaseObject));
+			}
+		}
+	}
+
+	auto position = std::uint64_t{ 0 };
+	auto write = [&stream, &position](const void* data, const std::size_t bytes) {
+		stream.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+		position += bytes;
+	};
+	auto pad = [&write, &position](const std::uint64_t offset) {
+		static constexpr char zeros[64] = {};
+		while (position < offset) {
+			write(zeros, static_cast<std::size_t>(std::min<std::uint64_t>(offset - position, sizeof(zeros))));
+		}
+	};
+
+	write(&header, sizeof(header));
+	write(image_storages.data(), sizeof(ImageStorage) * image_storages.size());
+	write(image_children.data(), sizeof(ImageChild) * image_children.size());
+
+	pad(header.data_offset);
+	write(image_data.data(), image_data.size());
+
+	return static_cast<bool>(stream);
+}
+
+void GC::Impl::load_image(const char* path, BaseObject* root, const std::size_t root_size, const std::size_t root_alignment, const bool root_is_array)
+{
+	SABER_GC_ASSERT(path && root && !root->storage_);
+
+	std::size_t bytes = 0;
+	auto pointer = Pages::map_file(path, bytes);
+	if (!pointer) {
+		return;
+	}
+
+	auto data = static_cast<std::byte*>(pointer);
+	ImageHeader header;
+	std::memcpy(&header, data, std::min(bytes, sizeof(header)));
+	const ImageStorage* image_storages = nullptr;
+	const ImageChild* image_children = nullptr;
+
+	// Every offset is validated before relocating, since the image is not trusted.
+	auto is_valid = [&]() {
+		if (bytes < sizeof(header) || std::memcmp(header.magic, "SGCI", sizeof(header.magic)) != 0 || header.version != IMAGE_VERSION ||
+			header.pointer_size != sizeof(void*) || header.object_size != sizeof(BaseObject)) {
+			return false;
+		}
+		if (header.root_size != root_size || header.root_alignment != root_alignment || header.root_is_array != static_cast<std::uint64_t>(root_is_array)) {
+			return false;
+		}
+		if (header.storage_count > bytes / sizeof(ImageStorage) || header.child_count > bytes / sizeof(ImageChild) ||
+			header.data_offset < sizeof(ImageHeader) + sizeof(ImageStorage) * header.storage_count + sizeof(ImageChild) * header.child_count ||
+			header.data_offset % alignof(std::max_align_t) != 0 || header.data_offset > bytes || header.data_bytes > bytes - header.data_offset) {
+			return false;
+		}
+		image_storages = reinterpret_cast<const ImageStorage*>(data + sizeof(ImageHeader));
+		image_children = reinterpret_cast<const ImageChild*>(image_storages + header.storage_count);
+
+		std::uint64_t end = 0;
+		for (std::uint64_t i = 0; i < header.storage_count; ++i) {
+			auto&& storage = image_storages[i];
+			if (storage.alignment == 0 || (storage.alignment & (storage.alignment - 1)) != 0 || storage.alignment > Pages::get_size() ||
+				(header.data_offset + storage.offset) % storage.alignment != 0 || storage.bytes == 0 || storage.bytes % storage.alignment != 0 ||
+				storage.offset < end || storage.offset > header.data_bytes || storage.bytes > header.data_bytes - storage.offset) {
+				return false;
+			}
+			end = storage.offset + storage.bytes;
+		}
+
+		// Children are sorted by the parent and the offset, so that handles never overlap.
+		const ImageChild* previous = nullptr;
+		for (std::uint64_t i = 0; i < header.child_count; ++i) {
+			auto&& child = image_children[i];
+			if (child.parent >= header.storage_count || child.storage >= header.storage_count ||
+				(header.data_offset + image_storages[child.parent].offset + child.offset) % alignof(BaseObject) != 0 ||
+				image_storages[child.parent].bytes < sizeof(BaseObject) || child.offset > image_storages[child.parent].bytes - sizeof(BaseObject) ||
+				child.storage_offset >= image_storages[child.storage].bytes) {
+				return false;
+			}
+			if (previous && (child.parent < previous->parent || (child.parent == previous->parent && child.offset < previous->offset + sizeof(BaseObject)))) {
+				return false;
+			}
+			previous = &child;
+		}
+
+		if (header.storage_count == 0) {
+			return true;
+		}
+
+		// The root refers to elements of its type, which must lie within its storage.
+		if (header.root_storage >= header.storage_count) {
+			return false;
+		}
+		auto&& root_storage = image_storages[header.root_storage];
+		auto root_elements = std::max<std::uint64_t>(header.root_count, 1);
+		return (header.data_offset + root_storage.offset + header.root_offset) % root_alignment == 0 && header.root_offset < root_storage.bytes &&
+			root_elements <= (root_storage.bytes - header.root_offset) / root_size;
+	};
+
+	if (!is_valid() || header.storage_count == 0) {
+		Pages::unmap_file(pointer, bytes);
+		return;
+	}
+
+	// The chunk unmaps the file if it is not reserved on the heap.
+	Chunk mapped_chunk{ pointer, bytes, this };
+
+	auto locker = lock();
+
+	auto chunk = &chunks_.emplace(pointer, std::move(mapped_chunk)).first->second;
+
+	std::pmr::vector<Storage*> storages{ resource_ };
+	storages.reserve(static_cast<std::size_t>(header.storage_count));
+	for (std::uint64_t i = 0; i < header.storage_count; ++i) {
+		auto&& image_storage = image_storages[i];
+		auto storage_pointer = data + header.data_offset + image_storage.offset;
+		auto size = static_cast<std::size_t>(image_storage.bytes);
+		auto alignment = static_cast<std::size_t>(image_storage.alignment);
+
+		auto emplaced = storages_.emplace(storage_pointer, Storage{ storage_pointer, size, alignment, 1, chunk, this });
+		SABER_GC_ASSERT(emplaced.second);
+		emplaced.first->second.set_relocated(locker);
+		chunk->add_storage(locker);
+		storages.push_back(&emplaced.first->second);
+	}
+
+	auto address_of = [](Storage* storage, const std::uint64_t offset) {
+		return static_cast<std::byte*>(storage->get_pointer()) + offset;
+	};
+
+	// Handles are constructed in place of the zeroed ones, and registered as if they were assigned.
+	child_objects_.reserve(child_objects_.size() + static_cast<std::size_t>(header.child_count));
+	for (std::uint64_t i = 0; i < header.child_count; ++i) {
+		auto&& image_child = image_children[i];
+		auto parent = storages[static_cast<std::size_t>(image_child.parent)];
+		auto storage = storages[static_cast<std::size_t>(image_child.storage)];
+
+		auto child_object = ::new(address_of(parent, image_child.offset)) BaseObject{};
+		child_object->storage_ = address_of(storage, image_child.storage_offset);
+		child_object->impl_ = weak_from_this();
+		child_object->count_ = static_cast<std::size_t>(image_child.count);
+
+		child_objects_.emplace(child_object, storage);
+		parent->add_child(child_object, locker);
+		if (is_counted(*storage, locker)) {
+			storage->add_reference(locker);
+		}
+	}
+
+	auto storage = storages[static_cast<std::size_t>(header.root_storage)];
+	root->storage_ = address_of(storage, header.root_offset);
+	root->impl_ = shared_from_this();
+	root->count_ = static_cast<std::size_t>(header.root_count);
+	root_objects_.emplace(root, storage);
+	if (is_counted(*storage, locker)) {
+		storage->add_reference(locker);
+	}
+}
+
+GC::ShadowStack& GC::Impl::get_shadow_stack()
+{
+	return get_thread_buffer()->get_shadow_stack();
+}
+
+void GC::Impl::trace_copy_local(const BaseLocal* to, const void* from, const bool overwrite)
+{
+	if (is_tracing_) {
+		auto locker = lock();
+		if (trace_) {
+			trace_->write_copy_object(to, from, overwrite, { nullptr, 0 });
+		}
+	}
+}
+
+void GC::Impl::trace_remove_local(const BaseLocal* local)
+{
+	if (is_tracing_) {
+		auto locker = lock();
+		if (trace_) {
+			trace_->write_remove_object(local);
+		}
+	}
+}
+
+void GC::Impl::enter_region()
+{
+	auto buffer = get_thread_buffer();
+
+	auto locker = lock();
+
+	buffer->push_arena(locker);
+}
+
+void GC::Impl::leave_region()
+{
+	auto buffer = find_thread_buffer();
+	SABER_GC_ASSERT(buffer);
+
+	// Moving erasing containers to this container prevents the mutex from being double-locked.
+	std::pmr::deque<Chunk> erased_chunks{ resource_ };
+	std::pmr::deque<Storage> erased_storages{ resource_ };
+
+	auto locker = lock();
+
+	buffer->publish(locker);
+
+	auto arena = buffer->get_arena();
+	SABER_GC_ASSERT(arena);
+
+	auto&& storages = arena->get_storages(locker);
+
+	// References between storages in the region are counted apart from the others.
+	std::pmr::unordered_map<const Storage*, std::size_t> internal_counts{ resource_ };
+	internal_counts.reserve(storages.size());
+	for (auto&& storage : storages) {
+		storage.second.unmark(locker);
+		for (auto&& child_object : storage.second.get_unique_children(locker)) {
+			auto found = child_objects_.find(child_object);
+			if (found != child_objects_.end() && found->second && found->second->get_arena(locker) == arena) {
+				++internal_counts[found->second];
+			}
+		}
+	}
+
+	// Only storages reachable from outside of the region survive.
+	// Locals may also refer into the region after leaving it.
+	for (auto&& storage : storages) {
+		auto found = internal_counts.find(&storage.second);
+		auto internal_count = found != internal_counts.end() ? found->second : 0;
+		if (storage.second.get_reference_count(locker) > internal_count) {
+			storage.second.mark(locker);
+		}
+	}
+	for_each_local_storage([arena, &locker](auto storage) {
+		if (storage->get_arena(locker) == arena) {
+			storage->mark(locker);
+		}
+	}, locker);
+
+	for (auto&& storage : storages) {
+		if (!storage.second.is_marked(locker)) {
+			detach_children(storage.second, locker);
+		}
+	}
+
+	// Releases the region, and promotes surviving storages to the heap.
+	for (auto it = storages.begin(); it != storages.end();) {
+		if (it->second.is_marked(locker)) {
+			storages_.insert(storages.extract(it++));
+		}
+		else {
+			erased_storages.push_back(std::move(it->second));
+			it = storages.erase(it);
+		}
+	}
+
+	release_arena(*arena, erased_chunks, locker);
+	buffer->pop_arena(locker);
+
+	destruct_storages(erased_storages, erased_chunks, locker);
+	locker.unlock();
+}
+
+std::pair<void*, bool> GC::Impl::new_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count)
+{
+	auto result = allocate_object(object, size, alignment, count);
+
+	if (is_tracing_) {
+		auto locker = lock();
+		if (trace_) {
+			trace_->write_new_object(object, result.first, size, alignment, count, find_trace_location(object, result.second, locker));
+		}
+	}
+
+	return result;
+}
+
+std::pair<void*, bool> GC::Impl::allocate_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count)
+{
+	auto buffer = get_thread_buffer();
+
+	// Large objects are mapped separately so that their pages are returned to the OS as soon as they die.
+	auto is_large = size * count >= large_object_threshold_ && alignment <= Pages::get_size();
+
+	// Small objects are allocated from the chunk of the thread buffer without lock.
+	if (!is_large && size * count <= CHUNK_OBJECT_SIZE_LIMIT && alignment <= alignof(std::max_align_t)) {
+		if (auto result = buffer->new_object(object, size, alignment, count); result.first) {
+			return result;
+		}
+
+		// Refills the thread buffer with a chunk having free ranges, a free one retained by the previous collection, or a new one.
+		// Chunks of a region are kept until leaving it, and only new or free ones are added to it.
+		// Garbages are collected in an emergency before a new chunk exceeds the hard limit, so that chunks still in use are recycled.
+		std::pmr::deque<Chunk> erased_chunks{ resource_ };
+		auto arena = buffer->get_arena();
+		std::optional<Chunk> chunk;
+		for (auto is_collected = false;; is_collected = true) {
+			if (!arena) {
+				auto locker = lock();
+
+				buffer->publish(locker);
+
+				if (auto old_chunk = buffer->get_chunk()) {
+					old_chunk->set_owner(nullptr, locker);
+					buffer->set_chunk(nullptr);
+					if (old_chunk->is_unused(locker)) {
+						retire_chunk(old_chunk, erased_chunks, locker);
+					}
+				}
+
+				// Chunks whose free ranges are too small for the object are left until more of them are freed.
+				while (!recyclable_chunks_.empty()) {
+					auto recycled_chunk = *recyclable_chunks_.begin();
+					recyclable_chunks_.erase(recyclable_chunks_.begin());
+
+					recycled_chunk->set_owner(buffer, locker);
+					buffer->set_chunk(recycled_chunk);
+					if (auto result = buffer->new_object(object, size, alignment, count); result.first) {
+						return result;
+					}
+					recycled_chunk->set_owner(nullptr, locker);
+					buffer->set_chunk(nullptr);
+				}
+			}
+
+			if (heap_retention_ > 0) {
+				auto locker = lock();
+				if (!free_chunks_.empty()) {
+					chunk.emplace(std::move(free_chunks_.back()));
+					free_chunks_.pop_back();
+				}
+			}
+			if (chunk || is_collected || heap_bytes_ + CHUNK_SIZE <= hard_heap_limit_) {
+				break;
+			}
+			collect_in_emergency();
+		}
+		if (!chunk) {
+			chunk.emplace(CHUNK_SIZE, this);
+		}
+
+		auto locker = lock();
+
+		buffer->publish(locker);
+
+		auto emplaced = chunks_.emplace(chunk->get_pointer(), std::move(*chunk));
+		SABER_GC_ASSERT(emplaced.second);
+		emplaced.first->second.set_owner(buffer, locker);
+		emplaced.first->second.set_arena(arena, locker);
+		buffer->set_chunk(&emplaced.first->second);
+
+		auto result = buffer->new_object(object, size, alignment, count);
+		SABER_GC_ASSERT(result.first);
+		return result;
+	}
+
+	Storage storage{ size, alignment, count, is_large, this };
+	auto pointer = storage.get_pointer();
+
+	std::pair<void*, bool> result{ pointer, true };
+
+	buffer->begin_construction(object, pointer, size * count);
+
+	SABER_GC_TRY {
+		auto locker = lock();
+
+		auto&& storages = is_large ? large_storages_ : storages_;
+		auto emplaced = storages.emplace(pointer, std::move(storage));
+		SABER_GC_ASSERT(emplaced.second);
+
+		result.second = add_object(object, &emplaced.first->second, false, locker);
+	}
+	SABER_GC_CATCH_ALL {
+		buffer->abandon_construction(object);
+		SABER_GC_RETHROW;
+	}
+
+	return result;
+}
+
+void GC::Impl::set_destructor(const void* storage, void(*destructor)(void*, const std::size_t), const bool is_relocatable)
+{
+	SABER_GC_ASSERT(storage);
+
+	auto buffer = find_thread_buffer();
+	SABER_GC_ASSERT(buffer);
+
+	if (buffer->set_destructor(storage, destructor, is_relocatable)) {
+		return;
+	}
+
+	// The storage has been already published.
+	auto locker = lock();
+
+	auto found = find_published_storage(storage, locker);
+	SABER_GC_ASSERT(found.first && found.second->first == storage);
+
+	found.second->second.set_destructor(destructor, is_relocatable, locker);
+}
+
+void GC::Impl::reclaim_storages()
+{
+	if (!is_reference_counting_ || !has_zero_count_storages_) {
+		return;
+	}
+
+	// Storages reclaimed by destructors are reclaimed by the outermost call, instead of recursively.
+	auto buffer = get_thread_buffer();
+	if (buffer->is_reclaiming()) {
+		return;
+	}
+	buffer->set_reclaiming(true);
+
+	std::pmr::deque<Chunk> erased_chunks{ resource_ };
+	std::pmr::deque<Storage> erased_storages{ resource_ };
+	std::pmr::vector<const void*> zero_count_storages{ resource_ };
+
+	// Storage to be reclaimed unless it is referred by any local.
+	struct Candidate
+	{
+		storage_container_type* storages;
+		storage_iterator_type iterator;
+		bool is_local;
+	};
+	std::pmr::vector<Candidate> candidates{ resource_ };
+
+	SABER_GC_TRY {
+		auto locker = lock();
+		for (;;) {
+			zero_count_storages.swap(zero_count_storages_);
+			has_zero_count_storages_ = false;
+			if (zero_count_storages.empty()) {
+				break;
+			}
+
+			// Storages may have been collected or referred again since they are queued.
+			candidates.clear();
+			for (auto&& pointer : zero_count_storages) {
+				auto found = find_published_storage(pointer, locker);
+				if (found.first && found.second->first == pointer && !found.second->second.is_referenced(locker)) {
+					candidates.push_back({ found.first, found.second, false });
+				}
+			}
+			zero_count_storages.clear();
+			if (candidates.empty()) {
+				continue;
+			}
+
+			// Locals are not counted, so that storages referred by them are left to collection.
+			// Only the few candidates are looked up by addresses in slots, instead of every storage.
+			std::sort(candidates.begin(), candidates.end(), [](auto&& lhs, auto&& rhs) {
+				return lhs.iterator->first < rhs.iterator->first;
+			});
+			candidates.erase(std::unique(candidates.begin(), candidates.end(), [](auto&& lhs, auto&& rhs) {
+				return lhs.iterator == rhs.iterator;
+			}), candidates.end());
+			for (auto&& buffer : buffers_) {
+				buffer.get_shadow_stack().for_each([&candidates](auto storage) {
+					auto ub = std::upper_bound(candidates.begin(), candidates.end(), storage, [](auto address, auto&& candidate) {
+						return address < candidate.iterator->first;
+					});
+					if (ub != candidates.begin()) {
+						auto&& candidate = *std::prev(ub);
+						if (storage < static_cast<const std::byte*>(candidate.iterator->first) + candidate.iterator->second.get_bytes()) {
+							candidate.is_local = true;
+						}
+					}
+				});
+			}
+
+			for (auto&& candidate : candidates) {
+				if (!candidate.is_local) {
+					detach_children(candidate.iterator->second, locker);
+					erased_storages.push_back(std::move(candidate.iterator->second));
+					candidate.storages->erase(candidate.iterator);
+				}
+			}
+
+			destruct_storages(erased_storages, erased_chunks, locker);
+		}
+	}
+	SABER_GC_CATCH_ALL {
+		buffer->set_reclaiming(false);
+		SABER_GC_RETHROW;
+	}
+
+	buffer->set_reclaiming(false);
+}
+
+void GC::Impl::reserve_heap(const std::size_t bytes)
+{
+	// Collects proactively over the soft limit, by only one of threads crossing it.
+	auto trigger = collection_trigger_.load();
+	if (heap_bytes_ + bytes >= trigger && collection_trigger_.compare_exchange_strong(trigger, NO_HEAP_LIMIT)) {
+		collect();
+	}
+
+	if (try_reserve_heap(bytes)) {
+		return;
+	}
+
+	collect_in_emergency();
+
+	if (!try_reserve_heap(bytes)) {
+		SABER_GC_THROW(std::bad_alloc{});
+	}
+}
+
+void GC::Impl::collect_in_emergency()
+{
+	// Collects all garbages and free chunks on the hard limit, after storages swept by other threads are released.
+	// Destructors are not waited for by themselves, since they may be waited for by the others in turn.
+	collect();
+
+	std::pmr::deque<Chunk> erased_chunks{ resource_ };
+	auto locker = lock();
+	if (get_destruction_depth() == 0) {
+		destructed_.wait(locker, [this]() {
+			return destructing_count_ == 0;
+		});
+	}
+	trim_free_chunks(0, erased_chunks, locker);
+	locker.unlock();
+}
+
+void GC::Impl::release_heap(const std::size_t bytes) noexcept
+{
+	SABER_GC_ASSERT(heap_bytes_ >= bytes);
+
+	heap_bytes_ -= bytes;
+}
+
+std::unique_lock<std::mutex> GC::Impl::lock()
+{
+	return std::unique_lock<std::mutex>{ mutex_ };
+}
+
+bool GC::Impl::copy_object(const BaseObject* to, const BaseObject* from, const bool overwrite, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(from && locker && locker.mutex() == &mutex_);
+
+	auto found = find_object(from, locker);
+	SABER_GC_ASSERT(found.first);
+
+	// The destination may be pending, so that publishes it before overwriting.
+	if (overwrite) {
+		find_object(to, locker);
+	}
+
+	auto is_root_object = add_object(to, found.second->second, overwrite, locker);
+
+	if (trace_) {
+		trace_->write_copy_object(to, from, overwrite, find_trace_location(to, is_root_object, locker));
+	}
+
+	return is_root_object;
+}
+
+bool GC::Impl::copy_local(const BaseObject* to, const BaseLocal* from, const void* storage, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(from && storage && locker && locker.mutex() == &mutex_);
+
+	// The storage is alive while the local refers to it, even if it is not referred by any object.
+	auto found = find_storage(storage, locker);
+	SABER_GC_ASSERT(found);
+
+	auto is_root_object = add_object(to, found, false, locker);
+
+	if (trace_) {
+		trace_->write_copy_object(to, from, false, find_trace_location(to, is_root_object, locker));
+	}
+
+	return is_root_object;
+}
+
+void GC::Impl::remove_object(const BaseObject* object, [[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+
+	// The object may be removed while constructing its storage if the constructor throws.
+	if (auto buffer = find_thread_buffer()) {
+		buffer->abandon_construction(object);
+	}
+
+	auto found = find_object(object, locker);
+	SABER_GC_ASSERT(found.first);
+
+	// Children removed by destructing their storage are not traced, since they are destructed likewise on replay.
+	if (trace_ && (found.first == &root_objects_ || find_storage(object, locker))) {
+		trace_->write_remove_object(object);
+	}
+
+	release_storage(found.second->second, locker);
+	found.first->erase(found.second);
+}
+
+void GC::Impl::mark_child_object(const BaseObject* object, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+
+	auto found = child_objects_.find(object);
+	if (found != child_objects_.end() && found->second) {
+		found->second->mark(locker);
+	}
+}
+
+GC::Impl::ThreadBuffer* GC::Impl::get_thread_buffer()
+{
+	if (auto buffer = find_thread_buffer()) {
+		return buffer;
+	}
+
+	ThreadBuffer* buffer = nullptr;
+	{
+		auto locker = lock();
+		buffer = &buffers_.emplace_back(this);
+	}
+
+	SABER_GC_TRY {
+		get_thread_cache().insert(lifetime_, buffer);
+	}
+	SABER_GC_CATCH_ALL {
+		remove_thread_buffer(buffer);
+		SABER_GC_RETHROW;
+	}
+
+	return buffer;
+}
+
+GC::Impl::ThreadBuffer* GC::Impl::find_thread_buffer() const noexcept
+{
+	return get_thread_cache().find(this);
+}
+
+void GC::Impl::remove_thread_buffer(ThreadBuffer* buffer)
+{
+	SABER_GC_ASSERT(buffer);
+
+	std::pmr::deque<Chunk> erased_chunks{ resource_ };
+
+	auto locker = lock();
+
+	buffer->publish(locker);
+
+	// Regions left by exiting the thread are promoted to the heap as a whole, to be collected later.
+	for (auto&& arena : buffer->get_arenas(locker)) {
+		storages_.merge(arena.get_storages(locker));
+		release_arena(arena, erased_chunks, locker);
+	}
+	buffer->get_arenas(locker).clear();
+	if (auto chunk = buffer->get_chunk()) {
+		chunk->set_owner(nullptr, locker);
+		if (chunk->is_unused(locker)) {
+			retire_chunk(chunk, erased_chunks, locker);
+		}
+	}
+
+	for (auto it = buffers_.begin(); it != buffers_.end(); ++it) {
+		if (&*it == buffer) {
+			buffers_.erase(it);
+			break;
+		}
+	}
+}
+
+GC::Impl::ThreadCache& GC::Impl::get_thread_cache()
+{
+	thread_local ThreadCache cache;
+	return cache;
+}
+
+std::size_t& GC::Impl::get_destruction_depth()
+{
+	// Number of destruct_storages() running in the thread, which is nested when destructors collect.
+	thread_local std::size_t depth = 0;
+	return depth;
+}
+
+bool GC::Impl::add_object(const BaseObject* object, Storage* storage, const bool overwrite, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+
+	// Object is a child if it is inside of existing storage.
+	return register_object(object, storage, find_storage(object, locker), overwrite, locker);
+}
+
+bool GC::Impl::register_object(const BaseObject* object, Storage* storage, Storage* parent, const bool overwrite, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && storage && locker && locker.mutex() == &mutex_);
+
+	auto is_root_object = true;
+
+	if (parent) {
+		parent->add_child(object, locker);
+		is_root_object = false;
+	}
+
+	auto&& objects = is_root_object ? root_objects_ : child_objects_;
+
+	if (is_counted(*storage, locker)) {
+		storage->add_reference(locker);
+	}
+
+	if (overwrite) {
+		if (auto found = objects.find(object); found != objects.end()) {
+			release_storage(found->second, locker);
+			found->second = storage;
+		}
+		else {
+			objects.emplace(object, storage);
+		}
+	}
+	else {
+		auto emplaced = objects.emplace(object, storage);
+		SABER_GC_ASSERT(emplaced.second);
+	}
+
+	return is_root_object;
+}
+
+std::pair<GC::Impl::object_container_type*, GC::Impl::object_iterator_type> GC::Impl::find_object(const BaseObject* object, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+
+	auto find = [](auto object, auto impl) -> std::pair<object_container_type*, object_iterator_type> {
+		auto found = impl->root_objects_.find(object);
+		if (found != impl->root_objects_.end()) {
+			return { &impl->root_objects_, found };
+		}
+
+		found = impl->child_objects_.find(object);
+		if (found != impl->child_objects_.end()) {
+			return { &impl->child_objects_, found };
+		}
+
+		return { nullptr, found };
+	};
+
+	auto found = find(object, this);
+	if (found.first) {
+		return found;
+	}
+
+	// The object may be pending in the buffer of this thread mostly, or of others.
+	if (auto buffer = find_thread_buffer()) {
+		buffer->publish(locker);
+		found = find(object, this);
+		if (found.first) {
+			return found;
+		}
+	}
+
+	publish_thread_buffers(locker);
+	return find(object, this);
+}
+
+void GC::Impl::detach_children(const Storage& storage, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	// Children of the storage being destructed no longer refer to anything.
+	for (auto&& child_object : storage.get_children(locker)) {
+		auto found = child_objects_.find(child_object);
+		if (found != child_objects_.end() && found->second) {
+			release_storage(found->second, locker);
+			found->second = nullptr;
+		}
+	}
+}
+
+void GC::Impl::release_storage(Storage* storage, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	// Unmarked storages are being swept.
+	if (storage && is_counted(*storage, locker) && storage->release_reference(locker) && storage->is_marked(locker) && is_reference_counting_) {
+		zero_count_storages_.push_back(storage->get_pointer());
+		has_zero_count_storages_ = true;
+	}
+}
+
+bool GC::Impl::is_counted(const Storage& storage, const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	// References into regions are always counted to find storages escaping from them.
+	return is_reference_counting_ || storage.get_arena(locker);
+}
+
+GC::Impl::Storage* GC::Impl::find_storage(const void* address, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	auto found = find_published_storage(address, locker);
+	if (!found.first) {
+		// The storage may be pending in the thread buffer which owns the chunk.
+		auto chunk = chunks_.lower_bound(address);
+		if (chunk != chunks_.end() && chunk->second.contains(address)) {
+			if (auto owner = chunk->second.get_owner(locker)) {
+				owner->publish(locker);
+				found = find_published_storage(address, locker);
+			}
+		}
+	}
+
+	return found.first ? &found.second->second : nullptr;
+}
+
+std::pair<GC::Impl::storage_container_type*, GC::Impl::storage_iterator_type> GC::Impl::find_published_storage(const void* address, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	auto find = [address](auto&& storages) {
+		auto lb = storages.lower_bound(address);
+		if (lb != storages.end()) {
+			auto end_of_storage = static_cast<const void*>(static_cast<const std::byte*>(lb->first) + lb->second.get_bytes());
+			if (address >= lb->first && address < end_of_storage) {
+				return lb;
+			}
+		}
+		return storages.end();
+	};
+
+	for (auto&& storages : { &storages_, &large_storages_ }) {
+		if (auto found = find(*storages); found != storages->end()) {
+			return { storages, found };
+		}
+	}
+
+	// Storages in a region are found by the chunk of its arena.
+	auto chunk = chunks_.lower_bound(address);
+	if (chunk != chunks_.end() && chunk->second.contains(address)) {
+		if (auto arena = chunk->second.get_arena(locker)) {
+			auto&& storages = arena->get_storages(locker);
+			if (auto found = find(storages); found != storages.end()) {
+				return { &storages, found };
+			}
+		}
+	}
+
+	return { nullptr, storages_.end() };
+}
+
+template <class Function>
+void GC::Impl::for_each_storage_container(Function function, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	function(storages_);
+	function(large_storages_);
+	for (auto&& buffer : buffers_) {
+		for (auto&& arena : buffer.get_arenas(locker)) {
+			function(arena.get_storages(locker));
+		}
+	}
+}
+
+template <class Function>
+void GC::Impl::for_each_local_storage(Function function, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	for (auto&& buffer : buffers_) {
+		buffer.get_shadow_stack().for_each([this, &function, &locker](auto storage) {
+			if (auto found = find_storage(storage, locker)) {
+				function(found);
+			}
+		});
+	}
+}
+
+std::pair<const void*, std::size_t> GC::Impl::find_trace_location(const BaseObject* object, const bool is_root_object, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+
+	if (!is_root_object) {
+		if (auto found = find_storage(object, locker)) {
+			auto offset = static_cast<std::size_t>(reinterpret_cast<const std::byte*>(object) - static_cast<const std::byte*>(found->get_pointer()));
+			return { found->get_pointer(), offset };
+		}
+	}
+	return { nullptr, 0 };
+}
+
+void GC::Impl::publish_thread_buffers(const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	for (auto&& buffer : buffers_) {
+		buffer.publish(locker);
+	}
+}
+
+bool GC::Impl::try_reserve_heap(const std::size_t bytes) noexcept
+{
+	auto hard_heap_limit = hard_heap_limit_.load();
+	auto heap_bytes = heap_bytes_.load();
+	do {
+		if (bytes > hard_heap_limit || heap_bytes > hard_heap_limit - bytes) {
+			return false;
+		}
+	} while (!heap_bytes_.compare_exchange_weak(heap_bytes, heap_bytes + bytes));
+	return true;
+}
+
+void GC::Impl::retire_chunk(Chunk* chunk, std::pmr::deque<Chunk>& erased_chunks, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(chunk && locker && locker.mutex() == &mutex_);
+	SABER_GC_ASSERT(!chunk->get_owner(locker) && chunk->is_unused(locker));
+
+	auto found = chunks_.find(chunk->get_pointer());
+	SABER_GC_ASSERT(found != chunks_.end());
+
+	recyclable_chunks_.erase(chunk);
+
+	// Chunks are retained for reuse up to the retention, except images.
+	if (!chunk->is_mapped() && (free_chunks_.size() + 1) * CHUNK_SIZE <= heap_retention_) {
+		found->second.reset(locker);
+		free_chunks_.push_back(std::move(found->second));
+	}
+	else {
+		erased_chunks.push_back(std::move(found->second));
+	}
+	chunks_.erase(found);
+}
+
+void GC::Impl::release_arena(Arena& arena, std::pmr::deque<Chunk>& erased_chunks, const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	// Chunks of the arena are no longer allocated from, and retired once their storages are all destructed.
+	for (auto&& chunk : arena.get_chunks(locker)) {
+		chunk->set_arena(nullptr, locker);
+		chunk->set_owner(nullptr, locker);
+		if (chunk->is_unused(locker)) {
+			retire_chunk(chunk, erased_chunks, locker);
+		}
+	}
+}
+
+void GC::Impl::destruct_storages(std::pmr::deque<Storage>& erased_storages, std::pmr::deque<Chunk>& erased_chunks, std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	if (erased_storages.empty() && erased_chunks.empty()) {
+		return;
+	}
+
+	// Storages and chunks are counted from being erased until being released, so that emergency collections wait for them.
+	auto&& destruction_depth = get_destruction_depth();
+	++destructing_count_;
+	++destruction_depth;
+	auto finish = [this, &destruction_depth]() {
+		--destruction_depth;
+		--destructing_count_;
+		destructed_.notify_all();
+	};
+
+	SABER_GC_TRY {
+		// Destructs objects without lock since their destructors may remove child objects.
+		locker.unlock();
+		for (auto&& storage : erased_storages) {
+			storage.destruct();
+		}
+
+		// Chunks are retired after all of objects in them are destructed.
+		locker.lock();
+		for (auto&& storage : erased_storages) {
+			if (auto chunk = storage.get_chunk()) {
+				if (chunk->remove_storage(storage.get_pointer(), storage.get_bytes(), locker)) {
+					retire_chunk(chunk, erased_chunks, locker);
+				}
+				else if (chunk->is_recyclable(locker)) {
+					recyclable_chunks_.insert(chunk);
+				}
+			}
+		}
+		erased_storages.clear();
+
+		// Chunks are also freed without lock, before the end of the phase is notified.
+		locker.unlock();
+		erased_chunks.clear();
+		locker.lock();
+	}
+	SABER_GC_CATCH_ALL {
+		if (!locker) {
+			locker.lock();
+		}
+		finish();
+		SABER_GC_RETHROW;
+	}
+
+	finish();
+}
+
+void GC::Impl::trim_free_chunks(const std::size_t retention, std::pmr::deque<Chunk>& erased_chunks, [[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &mutex_);
+
+	while (!free_chunks_.empty() && free_chunks_.size() * CHUNK_SIZE > retention) {
+		erased_chunks.push_back(std::move(free_chunks_.back()));
+		free_chunks_.pop_back();
+	}
+}
+
+
+GC::Impl::Storage::Storage(const std::size_t size, const std::size_t alignment, const std::size_t count, const bool is_mapped, Impl* impl)
+	: pointer_{ nullptr }
+	, size_{ size }
+	, alignment_{ alignment }
+	, count_{ count }
+	, is_mapped_{ is_mapped }
+	, impl_{ impl }
+	, child_objects_{ impl->resource_ }
+{
+	SABER_GC_ASSERT(size % alignment == 0 && count > 0 && impl);
+
+	impl->reserve_heap(get_heap_bytes());
+
+	if (is_mapped) {
+		SABER_GC_ASSERT(alignment <= Pages::get_size());
+
+		pointer_ = Pages::map(size * count);
+		if (!pointer_) {
+			impl->collect();
+			pointer_ = Pages::map(size * count);
+			if (!pointer_) {
+				impl->release_heap(get_heap_bytes());
+				SABER_GC_THROW(std::bad_alloc{});
+			}
+		}
+		return;
+	}
+
+	SABER_GC_TRY {
+		pointer_ = impl->resource_->allocate(size * count, alignment);
+	}
+	SABER_GC_CATCH_ALL {
+		SABER_GC_TRY {
+			impl->collect();
+			pointer_ = impl->resource_->allocate(size * count, alignment);
+		}
+		SABER_GC_CATCH_ALL {
+			impl->release_heap(get_heap_bytes());
+			SABER_GC_RETHROW;
+		}
+	}
+}
+
+GC::Impl::Storage::Storage(void* pointer, const std::size_t size, const std::size_t alignment, const std::size_t count, Chunk* chunk, Impl* impl) noexcept
+	: pointer_{ pointer }
+	, size_{ size }
+	, alignment_{ alignment }
+	, count_{ count }
+	, chunk_{ chunk }
+	, impl_{ impl }
+	, child_objects_{ impl->resource_ }
+{
+	SABER_GC_ASSERT(pointer && size % alignment == 0 && count > 0 && chunk && impl);
+}
+
+GC::Impl::Storage::Storage(Storage&& other) noexcept
+	: pointer_{ other.pointer_ }
+	, size_{ other.size_ }
+	, alignment_{ other.alignment_ }
+	, count_{ other.count_ }
+	, destructor_{ other.destructor_ }
+	, chunk_{ other.chunk_ }
+	, is_mapped_{ other.is_mapped_ }
+	, is_relocatable_{ other.is_relocatable_ }
+	, is_relocated_{ other.is_relocated_ }
+	, impl_{ other.impl_ }
+	, child_objects_{ std::move(other.child_objects_) }
+	, reference_count_{ other.reference_count_ }
+	, is_marked_{ other.is_marked_ }
+{
+	other.pointer_ = nullptr; // Prevents double-freeing.
+}
+
+GC::Impl::Storage::~Storage()
+{
+	if (pointer_) {
+		destruct();
+		// Memory in a chunk is deallocated with the chunk.
+		if (is_mapped_) {
+			Pages::unmap(pointer_, size_ * count_);
+			impl_->release_heap(get_heap_bytes());
+		}
+		else if (!chunk_) {
+			impl_->resource_->deallocate(pointer_, size_ * count_, alignment_);
+			impl_->release_heap(get_heap_bytes());
+		}
+	}
+}
+
+void* GC::Impl::Storage::get_pointer() const noexcept
+{
+	return pointer_;
+}
+
+std::size_t GC::Impl::Storage::get_bytes() const noexcept
+{
+	return size_ * count_;
+}
+
+std::size_t GC::Impl::Storage::get_alignment() const noexcept
+{
+	return alignment_;
+}
+
+GC::Impl::Chunk* GC::Impl::Storage::get_chunk() const noexcept
+{
+	return chunk_;
+}
+
+std::size_t GC::Impl::Storage::get_heap_bytes() const noexcept
+{
+	return is_mapped_ ? Pages::round_up(size_ * count_) : size_ * count_;
+}
+
+GC::Impl::Arena* GC::Impl::Storage::get_arena(const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return chunk_ ? chunk_->get_arena(locker) : nullptr;
+}
+
+void GC::Impl::Storage::destruct()
+{
+	if (pointer_ && destructor_) {
+		auto destructor = destructor_;
+		destructor_ = nullptr; // Prevents double-destructing.
+		destructor(pointer_, count_);
+	}
+	else if (pointer_ && is_relocated_) {
+		is_relocated_ = false; // Prevents double-destructing.
+
+		// Relocatable objects destruct nothing but their children, which are listed again whenever they are assigned.
+		std::sort(child_objects_.begin(), child_objects_.end());
+		child_objects_.erase(std::unique(child_objects_.begin(), child_objects_.end()), child_objects_.end());
+		for (auto&& child_object : child_objects_) {
+			const_cast<BaseObject*>(child_object)->~BaseObject();
+		}
+	}
+}
+
+void GC::Impl::Storage::set_destructor(void(*destructor)(void*, const std::size_t), const bool is_relocatable, [[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(destructor && locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(!destructor_);
+
+	destructor_ = destructor;
+	is_relocatable_ = is_relocatable;
+}
+
+bool GC::Impl::Storage::is_relocatable([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return is_relocatable_;
+}
+
+void GC::Impl::Storage::set_relocated([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(!destructor_);
+
+	is_relocatable_ = true;
+	is_relocated_ = true;
+}
+
+void GC::Impl::Storage::add_child(const BaseObject* object, [[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(object && locker && locker.mutex() == &impl_->mutex_);
+
+	child_objects_.push_back(object);
+}
+
+const std::pmr::vector<const GC::BaseObject*>& GC::Impl::Storage::get_children([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return child_objects_;
+}
+
+const std::pmr::vector<const GC::BaseObject*>& GC::Impl::Storage::get_unique_children([[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	// Children are listed again whenever they are assigned.
+	std::sort(child_objects_.begin(), child_objects_.end());
+	child_objects_.erase(std::unique(child_objects_.begin(), child_objects_.end()), child_objects_.end());
+	return child_objects_;
+}
+
+void GC::Impl::Storage::add_reference([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	++reference_count_;
+}
+
+bool GC::Impl::Storage::release_reference([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(reference_count_ > 0);
+
+	// Returns true if the storage is no longer referred.
+	return --reference_count_ == 0;
+}
+
+void GC::Impl::Storage::reset_references([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	reference_count_ = 0;
+}
+
+bool GC::Impl::Storage::is_referenced([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return reference_count_ > 0;
+}
+
+std::size_t GC::Impl::Storage::get_reference_count([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return reference_count_;
+}
+
+bool GC::Impl::Storage::is_marked([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return is_marked_;
+}
+
+void GC::Impl::Storage::mark(const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	if (!is_marked_) {
+		is_marked_ = true;
+		for (auto&& child_object : child_objects_) {
+			impl_->mark_child_object(child_object, locker);
+		}
+	}
+}
+
+void GC::Impl::Storage::unmark([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	is_marked_ = false;
+}
+
+
+std::size_t GC::Impl::Pages::get_size() noexcept
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return static_cast<std::size_t>(info.dwPageSize);
+#else // defined(_WIN32)
+	return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif // defined(_WIN32)
+}
+
+std::size_t GC::Impl::Pages::round_up(const std::size_t bytes) noexcept
+{
+	auto size = get_size();
+	return (bytes + size - 1) / size * size;
+}
+
+void* GC::Impl::Pages::map(const std::size_t bytes) noexcept
+{
+	SABER_GC_ASSERT(bytes > 0);
+
+#if defined(_WIN32)
+	return VirtualAlloc(nullptr, round_up(bytes), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else // defined(_WIN32)
+	auto pointer = mmap(nullptr, round_up(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return pointer != MAP_FAILED ? pointer : nullptr;
+#endif // defined(_WIN32)
+}
+
+void GC::Impl::Pages::unmap(void* pointer, [[maybe_unused]] const std::size_t bytes) noexcept
+{
+	SABER_GC_ASSERT(pointer);
+
+#if defined(_WIN32)
+	VirtualFree(pointer, 0, MEM_RELEASE);
+#else // defined(_WIN32)
+	munmap(pointer, round_up(bytes));
+#endif // defined(_WIN32)
+}
+
+void* GC::Impl::Pages::map_file(const char* path, std::size_t& bytes) noexcept
+{
+	SABER_GC_ASSERT(path);
+
+	// Pages are copied on write, so that the file is never modified.
+	void* pointer = nullptr;
+#if defined(_WIN32)
+	auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+		if (auto mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr)) {
+			pointer = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+		bytes = static_cast<std::size_t>(size.QuadPart);
+	}
+	CloseHandle(file);
+#else // defined(_WIN32)
+	auto file = open(path, O_RDONLY);
+	if (file < 0) {
+		return nullptr;
+	}
+	struct stat status;
+	if (fstat(file, &status) == 0 && status.st_size > 0) {
+		bytes = static_cast<std::size_t>(status.st_size);
+		pointer = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+		if (pointer == MAP_FAILED) {
+			pointer = nullptr;
+		}
+	}
+	close(file);
+#endif // defined(_WIN32)
+	return pointer;
+}
+
+void GC::Impl::Pages::unmap_file(void* pointer, [[maybe_unused]] const std::size_t bytes) noexcept
+{
+	SABER_GC_ASSERT(pointer);
+
+#if defined(_WIN32)
+	UnmapViewOfFile(pointer);
+#else // defined(_WIN32)
+	munmap(pointer, bytes);
+#endif // defined(_WIN32)
+}
+
+
+GC::Impl::Chunk::Chunk(const std::size_t bytes, Impl* impl)
+	: pointer_{ nullptr }
+	, bytes_{ bytes }
+	, owned_ranges_{ impl->resource_ }
+	, impl_{ impl }
+	, free_ranges_{ impl->resource_ }
+{
+	SABER_GC_ASSERT(bytes > 0 && impl);
+
+	impl->reserve_heap(bytes);
+
+	SABER_GC_TRY {
+		pointer_ = static_cast<std::byte*>(impl->resource_->allocate(bytes, alignof(std::max_align_t)));
+	}
+	SABER_GC_CATCH_ALL {
+		SABER_GC_TRY {
+			impl->collect();
+			pointer_ = static_cast<std::byte*>(impl->resource_->allocate(bytes, alignof(std::max_align_t)));
+		}
+		SABER_GC_CATCH_ALL {
+			impl->release_heap(bytes);
+			SABER_GC_RETHROW;
+		}
+	}
+}
+
+GC::Impl::Chunk::Chunk(void* pointer, const std::size_t bytes, Impl* impl)
+	: pointer_{ static_cast<std::byte*>(pointer) }
+	, bytes_{ bytes }
+	, top_{ bytes }
+	, owned_ranges_{ impl->resource_ }
+	, is_mapped_{ true }
+	, impl_{ impl }
+	, free_ranges_{ impl->resource_ }
+{
+	SABER_GC_ASSERT(pointer && bytes > 0 && impl);
+
+	SABER_GC_TRY {
+		impl->reserve_heap(bytes);
+	}
+	SABER_GC_CATCH_ALL {
+		Pages::unmap_file(pointer, bytes);
+		SABER_GC_RETHROW;
+	}
+}
+
+GC::Impl::Chunk::Chunk(Chunk&& other) noexcept
+	: pointer_{ other.pointer_ }
+	, bytes_{ other.bytes_ }
+	, top_{ other.top_ }
+	, owned_ranges_{ std::move(other.owned_ranges_) }
+	, owned_range_{ owned_ranges_.begin() }
+	, is_mapped_{ other.is_mapped_ }
+	, impl_{ other.impl_ }
+	, owner_{ other.owner_ }
+	, arena_{ other.arena_ }
+	, storage_count_{ other.storage_count_ }
+	, free_ranges_{ std::move(other.free_ranges_) }
+	, freed_bytes_{ other.freed_bytes_ }
+{
+	// Chunks are moved only while they have no owner.
+	SABER_GC_ASSERT(!owner_);
+
+	other.pointer_ = nullptr; // Prevents double-freeing.
+}
+
+GC::Impl::Chunk::~Chunk()
+{
+	if (pointer_) {
+		if (is_mapped_) {
+			Pages::unmap_file(pointer_, bytes_);
+		}
+		else {
+			impl_->resource_->deallocate(pointer_, bytes_, alignof(std::max_align_t));
+		}
+		impl_->release_heap(bytes_);
+	}
+}
+
+void* GC::Impl::Chunk::get_pointer() const noexcept
+{
+	return pointer_;
+}
+
+std::size_t GC::Impl::Chunk::get_bytes() const noexcept
+{
+	return bytes_;
+}
+
+bool GC::Impl::Chunk::contains(const void* address) const noexcept
+{
+	return address >= pointer_ && address < pointer_ + bytes_;
+}
+
+bool GC::Impl::Chunk::is_mapped() const noexcept
+{
+	return is_mapped_;
+}
+
+void* GC::Impl::Chunk::allocate(const std::size_t bytes, const std::size_t alignment) noexcept
+{
+	// Free ranges are filled in order of addresses before the rest of the chunk.
+	// Ranges too small are skipped until the owner returns them.
+	for (; owned_range_ != owned_ranges_.end(); ++owned_range_) {
+		if (auto pointer = allocate(owned_range_->second, owned_range_->first, bytes, alignment)) {
+			return pointer;
+		}
+	}
+	return allocate(top_, bytes_, bytes, alignment);
+}
+
+void* GC::Impl::Chunk::allocate(std::size_t& begin, const std::size_t end, const std::size_t bytes, const std::size_t alignment) noexcept
+{
+	void* pointer = pointer_ + begin;
+	auto space = end - begin;
+	if (!std::align(alignment, bytes, pointer, space)) {
+		return nullptr;
+	}
+
+	begin = end - space + bytes;
+	return pointer;
+}
+
+GC::Impl::ThreadBuffer* GC::Impl::Chunk::get_owner([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return owner_;
+}
+
+void GC::Impl::Chunk::set_owner(ThreadBuffer* owner, [[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(!owner_ != !owner);
+
+	owner_ = owner;
+
+	// Free ranges are handed over to the new owner, which allocates from them without lock.
+	if (owner) {
+		SABER_GC_ASSERT(owned_ranges_.empty());
+		owned_ranges_.swap(free_ranges_);
+		owned_range_ = owned_ranges_.begin();
+		freed_bytes_ = 0;
+		return;
+	}
+
+	// Ranges left by the owner are returned, and merged with ones freed in the meantime.
+	for (auto it = owned_ranges_.begin(); it != owned_ranges_.end();) {
+		if (it->second == it->first) {
+			it = owned_ranges_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	free_ranges_.merge(owned_ranges_);
+	SABER_GC_ASSERT(owned_ranges_.empty());
+	for (auto it = free_ranges_.begin(); it != free_ranges_.end();) {
+		auto next = std::next(it);
+		coalesce(it);
+		it = next;
+	}
+}
+
+GC::Impl::Arena* GC::Impl::Chunk::get_arena([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return arena_;
+}
+
+void GC::Impl::Chunk::set_arena(Arena* arena, [[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	arena_ = arena;
+}
+
+void GC::Impl::Chunk::add_storage([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	++storage_count_;
+}
+
+bool GC::Impl::Chunk::remove_storage(const void* pointer, const std::size_t bytes, [[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(storage_count_ > 0 && contains(pointer));
+
+	// Returns true if the chunk should be retired.
+	if (--storage_count_ == 0 && !owner_) {
+		return true;
+	}
+
+	// The storage is free to be allocated again, except in images.
+	if (!is_mapped_) {
+		auto begin = static_cast<std::size_t>(static_cast<const std::byte*>(pointer) - pointer_);
+		auto emplaced = free_ranges_.emplace(begin + bytes, begin);
+		SABER_GC_ASSERT(emplaced.second);
+		freed_bytes_ += bytes;
+		coalesce(emplaced.first);
+	}
+	return false;
+}
+
+bool GC::Impl::Chunk::is_unused([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return storage_count_ == 0;
+}
+
+bool GC::Impl::Chunk::is_recyclable([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	// Chunks of regions are kept apart until leaving them.
+	return !owner_ && !arena_ && !is_mapped_ && freed_bytes_ >= CHUNK_RECYCLING_BYTES;
+}
+
+void GC::Impl::Chunk::reset([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(!owner_ && storage_count_ == 0);
+
+	top_ = 0;
+	free_ranges_.clear();
+	freed_bytes_ = 0;
+	arena_ = nullptr;
+}
+
+void GC::Impl::Chunk::coalesce(range_container_type::iterator range) noexcept
+{
+	// The previous range ends where this one begins, and the next one begins where this one ends.
+	if (range != free_ranges_.begin()) {
+		if (auto previous = std::prev(range); previous->first == range->second) {
+			range->second = previous->second;
+			free_ranges_.erase(previous);
+		}
+	}
+	if (auto next = std::next(range); next != free_ranges_.end() && next->second == range->first) {
+		next->second = range->second;
+		free_ranges_.erase(range);
+		return;
+	}
+
+	// The rest of the chunk is owned by the owner, if any.
+	if (!owner_ && range->first == top_) {
+		top_ = range->second;
+		free_ranges_.erase(range);
+	}
+}
+
+
+GC::Impl::Arena::Arena(Impl* impl)
+	: impl_{ impl }
+	, chunks_{ impl->resource_ }
+	, storages_{ impl->resource_ }
+{
+	SABER_GC_ASSERT(impl);
+}
+
+GC::Impl::Chunk* GC::Impl::Arena::get_chunk() const noexcept
+{
+	return chunks_.empty() ? nullptr : chunks_.back();
+}
+
+void GC::Impl::Arena::add_chunk(Chunk* chunk)
+{
+	SABER_GC_ASSERT(chunk);
+
+	chunks_.push_back(chunk);
+}
+
+const std::pmr::vector<GC::Impl::Chunk*>& GC::Impl::Arena::get_chunks([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return chunks_;
+}
+
+GC::Impl::storage_container_type& GC::Impl::Arena::get_storages([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+
+	return storages_;
+}
+
+
+GC::ShadowStack::ShadowStack(Impl* impl, std::pmr::memory_resource* resource)
+	: impl_{ impl }
+	, slots_{ resource }
+{
+	SABER_GC_ASSERT(impl);
+}
+
+GC::Impl* GC::ShadowStack::get_impl() const noexcept
+{
+	return impl_;
+}
+
+std::size_t GC::ShadowStack::push(const void* storage)
+{
+	SABER_GC_ASSERT(storage);
+
+	auto index = size_.load(std::memory_order_relaxed);
+	if (index == slots_.size()) {
+		std::lock_guard<std::mutex> locker{ mutex_ };
+		slots_.emplace_back();
+	}
+
+	auto&& slot = slots_[index];
+	slot.storage.store(storage, std::memory_order_relaxed);
+	slot.is_popped = false;
+	size_.store(index + 1, std::memory_order_release);
+
+	return index;
+}
+
+void GC::ShadowStack::set(const std::size_t index, const void* storage)
+{
+	SABER_GC_ASSERT(storage);
+	SABER_GC_ASSERT(index < size_.load(std::memory_order_relaxed) && !slots_[index].is_popped);
+
+	// The previous storage may have been copied above the top, where collection may have not reached yet.
+	if (index + 1 == size_.load(std::memory_order_relaxed)) {
+		slots_[index].storage.store(storage, std::memory_order_relaxed);
+	}
+	else {
+		std::lock_guard<std::mutex> locker{ mutex_ };
+		slots_[index].storage.store(storage, std::memory_order_relaxed);
+	}
+}
+
+void GC::ShadowStack::pop(const std::size_t index) noexcept
+{
+	auto size = size_.load(std::memory_order_relaxed);
+	SABER_GC_ASSERT(index < size && !slots_[index].is_popped);
+
+	slots_[index].is_popped = true;
+
+	if (index + 1 == size) {
+		while (size > 0 && slots_[size - 1].is_popped) {
+			--size;
+		}
+		size_.store(size, std::memory_order_release);
+	}
+}
+
+template <class Function>
+void GC::ShadowStack::for_each(Function function)
+{
+	std::lock_guard<std::mutex> locker{ mutex_ };
+
+	// Slots may be pushed or popped meanwhile, which leaves storages referred by them in the slots below.
+	auto size = size_.load(std::memory_order_acquire);
+	for (auto i = decltype(size){ 0 }; i < size; ++i) {
+		if (auto storage = slots_[i].storage.load(std::memory_order_relaxed)) {
+			function(storage);
+		}
+	}
+}
+
+
+GC::Impl::ThreadBuffer::ThreadBuffer(Impl* impl)
+	: impl_{ impl }
+	, arenas_{ impl->resource_ }
+	, storages_{ impl->resource_ }
+	, constructions_{ impl->resource_ }
+	, shadow_stack_{ impl, impl->resource_ }
+{
+	SABER_GC_ASSERT(impl);
+}
+
+std::pair<void*, bool> GC::Impl::ThreadBuffer::new_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count)
+{
+	SABER_GC_ASSERT(object);
+
+	auto chunk = get_chunk();
+	if (!chunk) {
+		return { nullptr, false };
+	}
+
+	// Slots are rewound once all of them have been published.
+	auto index = size_.load(std::memory_order_relaxed);
+	if (index > 0 && published_size_.load(std::memory_order_acquire) == index) {
+		std::lock_guard<std::mutex> buffer_locker{ mutex_ };
+		size_.store(0, std::memory_order_relaxed);
+		published_size_.store(0, std::memory_order_relaxed);
+		++generation_;
+		index = 0;
+	}
+
+	// Reserves first so that nothing is left behind on failure.
+	if (index == storages_.size()) {
+		std::lock_guard<std::mutex> buffer_locker{ mutex_ };
+		storages_.emplace_back();
+	}
+	if (constructions_.size() == constructions_.capacity()) {
+		constructions_.reserve(constructions_.capacity() > 0 ? constructions_.capacity() * 2 : 16);
+	}
+
+	auto pointer = chunk->allocate(size * count, alignment);
+	if (!pointer) {
+		return { nullptr, false };
+	}
+
+	// Object is a child if it is inside of a storage under construction by this thread.
+	const void* parent = nullptr;
+	for (auto it = constructions_.rbegin(); it != constructions_.rend(); ++it) {
+		auto begin_of_storage = static_cast<const std::byte*>(it->storage);
+		auto address = reinterpret_cast<const std::byte*>(object);
+		if (address >= begin_of_storage && address < begin_of_storage + it->bytes) {
+			parent = it->storage;
+			break;
+		}
+	}
+
+	// The slot is not visible to publishers until the size is incremented.
+	auto&& pending = storages_[index];
+	pending.storage.emplace(pointer, size, alignment, count, chunk, impl_);
+	pending.object = object;
+	pending.parent = parent;
+	pending.destructor = nullptr;
+	pending.is_relocatable = false;
+	pending.state.store(PENDING_CONSTRUCTING, std::memory_order_relaxed);
+	size_.store(index + 1, std::memory_order_release);
+
+	constructions_.push_back({ object, pointer, size * count, index, generation_ });
+
+	return { pointer, parent == nullptr };
+}
+
+bool GC::Impl::ThreadBuffer::set_destructor(const void* storage, void(*destructor)(void*, const std::size_t), const bool is_relocatable) noexcept
+{
+	SABER_GC_ASSERT(storage && destructor);
+	SABER_GC_ASSERT(!constructions_.empty() && constructions_.back().storage == storage);
+
+	auto construction = constructions_.back();
+	constructions_.pop_back();
+
+	// Returns false if the storage has been already published.
+	if (construction.index == NOT_PENDING || construction.generation != generation_) {
+		return false;
+	}
+
+	// Publishers read the destructor only after it is handed over.
+	auto&& pending = storages_[construction.index];
+	pending.destructor = destructor;
+	pending.is_relocatable = is_relocatable;
+	auto state = PENDING_CONSTRUCTING;
+	return pending.state.compare_exchange_strong(state, PENDING_CONSTRUCTED, std::memory_order_acq_rel);
+}
+
+void GC::Impl::ThreadBuffer::begin_construction(const BaseObject* object, const void* storage, const std::size_t bytes)
+{
+	SABER_GC_ASSERT(object && storage);
+
+	constructions_.push_back({ object, storage, bytes, NOT_PENDING, 0 });
+}
+
+void GC::Impl::ThreadBuffer::abandon_construction(const BaseObject* object) noexcept
+{
+	if (!constructions_.empty() && constructions_.back().object == object) {
+		constructions_.pop_back();
+	}
+}
 
-GC::~GC() = default;
+GC::Impl::Chunk* GC::Impl::ThreadBuffer::get_chunk() const noexcept
+{
+	return arenas_.empty() ? chunk_ : arenas_.back().get_chunk();
+}
 
-GC& GC::operator=(GC&&) noexcept = default;
+void GC::Impl::ThreadBuffer::set_chunk(Chunk* chunk)
+{
+	if (arenas_.empty()) {
+		chunk_ = chunk;
+	}
+	else {
+		arenas_.back().add_chunk(chunk);
+	}
+}
 
-void GC::collect()
+GC::Impl::Arena* GC::Impl::ThreadBuffer::get_arena() noexcept
 {
-	impl_->collect();
+	return arenas_.empty() ? nullptr : &arenas_.back();
 }
 
+GC::ShadowStack& GC::Impl::ThreadBuffer::get_shadow_stack() noexcept
+{
+	return shadow_stack_;
+}
 
-GC::Impl::Impl(std::pmr::memory_resource* resource)
-	: resource_{ resource }
-	, storages_{ resource }
-	, root_objects_{ resource }
-	, child_objects_{ resource }
+bool GC::Impl::ThreadBuffer::is_reclaiming() const noexcept
 {
+	return is_reclaiming_;
 }
 
-GC::Impl::~Impl()
+void GC::Impl::ThreadBuffer::set_reclaiming(const bool reclaiming) noexcept
 {
-	// There must be no root objects because they have a shared_ptr<Impl>.
-	SABER_GC_ASSERT(root_objects_.size() == 0);
+	is_reclaiming_ = reclaiming;
 }
 
-void GC::Impl::collect()
+void GC::Impl::ThreadBuffer::publish(const std::unique_lock<std::mutex>& locker)
 {
-	// Moving erasing containers to this container prevents the mutex from being double-locked.
-	std::pmr::deque<Storage> erased_storages{ resource_ };
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
 
-	auto locker = lock();
+	std::lock_guard<std::mutex> buffer_locker{ mutex_ };
 
-	// Preparing.
-	for (auto&& storage : storages_) {
-		storage.second.unmark(locker);
+	auto begin = published_size_.load(std::memory_order_relaxed);
+	auto end = size_.load(std::memory_order_acquire);
+	if (begin >= end) {
+		return;
 	}
 
-	// Mark phase.
-	for (auto&& object : root_objects_) {
-		object.second->second.mark(locker);
-	}
+	for (auto i = begin; i < end; ++i) {
+		auto&& pending = storages_[i];
+		auto pointer = pending.storage->get_pointer();
+		auto chunk = pending.storage->get_chunk();
 
-	// Sweep phase.
-	for (auto it = storages_.begin(); it != storages_.end();) {
-		if (it->second.is_marked(locker)) {
-			++it;
-		} else {
-			erased_storages.push_back(std::move(it->second));
-			it = storages_.erase(it);
+		// Storages in a region are kept by its arena.
+		auto arena = chunk->get_arena(locker);
+		auto&& storages = arena ? arena->get_storages(locker) : impl_->storages_;
+		// Addresses mostly increase in a chunk, which come first in the descending order.
+		auto iterator = storages.emplace_hint(storages.begin(), pointer, std::move(*pending.storage));
+
+		chunk->add_storage(locker);
+		if (pending.state.exchange(PENDING_PUBLISHED, std::memory_order_acq_rel) == PENDING_CONSTRUCTED) {
+			iterator->second.set_destructor(pending.destructor, pending.is_relocatable, locker);
+		}
+
+		// Parent has been published before, since its storage is allocated earlier.
+		// It may have been swept already and be destructing the object, which is left referring to nothing until removed.
+		Storage* parent = nullptr;
+		if (pending.parent) {
+			auto found = impl_->find_published_storage(pending.parent, locker);
+			if (!found.first) {
+				impl_->child_objects_.emplace(pending.object, nullptr);
+				continue;
+			}
+			parent = &found.second->second;
 		}
+
+		impl_->register_object(pending.object, &iterator->second, parent, false, locker);
 	}
+
+	published_size_.store(end, std::memory_order_release);
 }
 
-std::pair<void*, bool> GC::Impl::new_object(const BaseObject* object, const std::size_t size, const std::size_t alignment, const std::size_t count)
+GC::Impl::arena_container_type& GC::Impl::ThreadBuffer::get_arenas([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
 {
-	Storage storage{ size, alignment, count, this };
-	auto pointer = storage.get_pointer();
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
 
-	auto locker = lock();
+	return arenas_;
+}
 
-	auto emplaced = storages_.emplace(pointer, std::move(storage));
-	SABER_GC_ASSERT(emplaced.second);
+void GC::Impl::ThreadBuffer::push_arena([[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+{
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
 
-	return { pointer, add_object(object, emplaced.first, false, locker) };
+	arenas_.emplace_back(impl_);
 }
 
-void GC::Impl::set_destructor(const void* storage, void(*destructor)(void*, const std::size_t))
+void GC::Impl::ThreadBuffer::pop_arena([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
 {
-	SABER_GC_ASSERT(storage);
+	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	SABER_GC_ASSERT(!arenas_.empty());
 
-	auto locker = lock();
+	arenas_.pop_back();
+}
 
-	auto iterator = storages_.find(storage);
-	SABER_GC_ASSERT(iterator != storages_.end());
 
-	iterator->second.set_destructor(destructor, locker);
+GC::Impl::ThreadCache::~ThreadCache()
+{
+	// Returns buffers of this thread to GC instances still alive.
+	for (auto&& entry : entries_) {
+		std::lock_guard<std::mutex> lifetime_locker{ entry.lifetime->mutex };
+		if (auto impl = entry.lifetime->impl.load()) {
+			impl->remove_thread_buffer(entry.buffer);
+		}
+	}
 }
 
-std::unique_lock<std::mutex> GC::Impl::lock()
+GC::Impl::ThreadBuffer* GC::Impl::ThreadCache::find(const Impl* impl) const noexcept
 {
-	return std::unique_lock<std::mutex>{ mutex_ };
+	for (auto&& entry : entries_) {
+		if (entry.lifetime->impl.load(std::memory_order_relaxed) == impl) {
+			return entry.buffer;
+		}
+	}
+	return nullptr;
 }
 
-bool GC::Impl::copy_object(const BaseObject* to, const BaseObject* from, const bool overwrite, const std::unique_lock<std::mutex>& locker)
+void GC::Impl::ThreadCache::insert(std::shared_ptr<Lifetime> lifetime, ThreadBuffer* buffer)
 {
-	SABER_GC_ASSERT(from && locker && locker.mutex() == &mutex_);
-
-	auto iterator = ([](auto object, auto impl) {
-		auto found = impl->root_objects_.find(object);
-		if (found != impl->root_objects_.end()) {
-			return found->second;
-		}
+	SABER_GC_ASSERT(lifetime && buffer);
 
-		found = impl->child_objects_.find(object);
-		if (found != impl->child_objects_.end()) {
-			return found->second;
+	// Drops entries for GC instances already destroyed.
+	for (auto it = entries_.begin(); it != entries_.end();) {
+		if (!it->lifetime->impl.load(std::memory_order_relaxed)) {
+			it = entries_.erase(it);
+		} else {
+			++it;
 		}
+	}
 
-		return impl->storages_.end();
-	})(from, this);
+	entries_.push_back({ std::move(lifetime), buffer });
+}
 
-	SABER_GC_ASSERT(iterator != storages_.end());
+GC::Impl::TraceWriter::TraceWriter(std::ostream& stream)
+	: stream_{ stream }
+{
+	stream_.write("SGCT", 4);
+	write(std::uintmax_t{ 1 });
+}
 
-	return add_object(to, iterator, overwrite, locker);
+GC::Impl::TraceWriter::~TraceWriter()
+{
+	stream_.flush();
 }
 
-void GC::Impl::remove_object(const BaseObject* object, [[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+bool GC::Impl::TraceWriter::flush()
 {
-	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+	// Writing stops at the first failure, which is reported here.
+	return static_cast<bool>(stream_.flush());
+}
 
-	auto erased = root_objects_.erase(object);
-	if (erased == 0) {
-		erased = child_objects_.erase(object);
+void GC::Impl::TraceWriter::write_new_object(const BaseObject* object, const void* storage, const std::size_t size, const std::size_t alignment, const std::size_t count, const std::pair<const void*, std::size_t>& location)
+{
+	if (!stream_) {
+		return;
 	}
-	SABER_GC_ASSERT(erased == 1);
+
+	stream_.put(static_cast<char>(TRACE_NEW_OBJECT));
+	write(object);
+	write(storage);
+	write(size);
+	write(alignment);
+	write(count);
+	write(location.first);
+	write(location.second);
 }
 
-void GC::Impl::mark_child_object(const BaseObject* object, const std::unique_lock<std::mutex>& locker)
+void GC::Impl::TraceWriter::write_copy_object(const void* to, const void* from, const bool overwrite, const std::pair<const void*, std::size_t>& location)
 {
-	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
-
-	auto found = child_objects_.find(object);
-	if (found != child_objects_.end()) {
-		found->second->second.mark(locker);
+	if (!stream_) {
+		return;
 	}
+
+	stream_.put(static_cast<char>(TRACE_COPY_OBJECT));
+	write(to);
+	write(from);
+	write(overwrite ? 1 : 0);
+	write(location.first);
+	write(location.second);
 }
 
-bool GC::Impl::add_object(const BaseObject* object, storage_iterator_type iterator, const bool overwrite, const std::unique_lock<std::mutex>& locker)
+void GC::Impl::TraceWriter::write_remove_object(const void* object)
 {
-	SABER_GC_ASSERT(object && locker && locker.mutex() == &mutex_);
+	if (!stream_) {
+		return;
+	}
 
-	auto is_root_object = true;
+	stream_.put(static_cast<char>(TRACE_REMOVE_OBJECT));
+	write(object);
+}
 
-	// Object is a child if it is inside of existing storage.
-	auto lb = storages_.lower_bound(object);
-	if (lb != storages_.end()) {
-		auto end_of_storage = static_cast<const void*>(static_cast<const std::byte*>(lb->first) + lb->second.get_bytes());
-		if (object >= lb->first && object < end_of_storage) {
-			lb->second.add_child(object, locker);
-			is_root_object = false;
-		}
+void GC::Impl::TraceWriter::write_collect()
+{
+	if (!stream_) {
+		return;
 	}
 
-	if (overwrite) {
-		(is_root_object ? root_objects_ : child_objects_).insert_or_assign(object, iterator);
-	}
-	else {
-		auto emplaced = (is_root_object ? root_objects_ : child_objects_).emplace(object, iterator);
-		SABER_GC_ASSERT(emplaced.second);
+	stream_.put(static_cast<char>(TRACE_COLLECT));
+}
+
+void GC::Impl::TraceWriter::write(std::uintmax_t value)
+{
+	while (value >= 0x80) {
+		stream_.put(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
 	}
+	stream_.put(static_cast<char>(value));
+}
 
-	return is_root_object;
+void GC::Impl::TraceWriter::write(const void* address)
+{
+	write(static_cast<std::uintmax_t>(reinterpret_cast<std::uintptr_t>(address)));
 }
 
 
-GC::Impl::Storage::Storage(const std::size_t size, const std::size_t alignment, const std::size_t count, Impl* impl)
-	: pointer_{ nullptr }
-	, size_{ size }
-	, alignment_{ alignment }
-	, count_{ count }
-	, impl_{ impl }
-	, child_objects_{ impl->resource_ }
+GC::Impl::TraceReader::TraceReader(std::istream& stream)
+	: stream_{ stream }
 {
-	SABER_GC_ASSERT(size % alignment == 0 && count > 0 && impl);
+	char magic[4] = {};
+	std::uintmax_t version = 0;
+	is_valid_ = stream_.read(magic, 4) && std::equal(magic, magic + 4, "SGCT") && read(version) && version == 1;
+}
 
-	SABER_GC_TRY {
-		pointer_ = impl->resource_->allocate(size * count, alignment);
-	}
-	SABER_GC_CATCH_ALL {
-		impl->collect();
-		pointer_ = impl->resource_->allocate(size * count, alignment); // There is no way to handle...
-	}
+bool GC::Impl::TraceReader::is_valid() const noexcept
+{
+	return is_valid_;
 }
 
-GC::Impl::Storage::Storage(Storage&& other) noexcept
-	: pointer_{ other.pointer_ }
-	, size_{ other.size_ }
-	, alignment_{ other.alignment_ }
-	, count_{ other.count_ }
-	, destructor_{ other.destructor_ }
-	, impl_{ other.impl_ }
-	, child_objects_{ std::move(other.child_objects_) }
-	, is_marked_{ other.is_marked_ }
+bool GC::Impl::TraceReader::read(Record& record)
 {
-	other.pointer_ = nullptr; // Prevents double-freeing.
+	if (!is_valid_) {
+		return false;
+	}
+
+	// The trace ends cleanly only between records.
+	auto tag = stream_.get();
+	if (tag == std::istream::traits_type::eof()) {
+		is_valid_ = !stream_.bad();
+		return false;
+	}
+
+	record = {};
+	record.tag = static_cast<TraceTag>(tag);
+	switch (record.tag) {
+	case TRACE_NEW_OBJECT:
+		is_valid_ = read(record.object) && read(record.storage) && read(record.size) && read(record.alignment) && read(record.count) && read(record.parent) && read(record.offset);
+		break;
+	case TRACE_COPY_OBJECT:
+		is_valid_ = read(record.object) && read(record.from) && read(record.overwrite) && read(record.parent) && read(record.offset);
+		break;
+	case TRACE_REMOVE_OBJECT:
+		is_valid_ = read(record.object);
+		break;
+	case TRACE_COLLECT:
+		break;
+	default:
+		is_valid_ = false;
+		break;
+	}
+	return is_valid_;
 }
 
-GC::Impl::Storage::~Storage()
+bool GC::Impl::TraceReader::read(std::uintmax_t& value)
 {
-	if (pointer_) {
-		if (destructor_) {
-			destructor_(pointer_, count_);
+	value = 0;
+	for (unsigned int shift = 0; shift < std::numeric_limits<std::uintmax_t>::digits; shift += 7) {
+		auto c = stream_.get();
+		if (c == std::istream::traits_type::eof()) {
+			return false;
+		}
+		value |= static_cast<std::uintmax_t>(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			return true;
 		}
-		impl_->resource_->deallocate(pointer_, size_ * count_, alignment_);
 	}
+	return false;
 }
 
-void* GC::Impl::Storage::get_pointer() const noexcept
+
+GC::Impl::Replayer::Replayer(GC& gc)
+	: gc_{ gc }
 {
-	return pointer_;
 }
 
-std::size_t GC::Impl::Storage::get_bytes() const noexcept
+std::optional<std::chrono::nanoseconds> GC::Impl::Replayer::replay(std::istream& stream)
 {
-	return size_ * count_;
+	TraceReader reader{ stream };
+	if (!reader.is_valid()) {
+		return std::nullopt;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	TraceReader::Record record;
+	auto is_valid = true;
+	while (is_valid && reader.read(record)) {
+		switch (record.tag) {
+		case TRACE_NEW_OBJECT:
+			is_valid = new_object(record);
+			break;
+		case TRACE_COPY_OBJECT:
+			is_valid = copy_object(record);
+			break;
+		case TRACE_REMOVE_OBJECT:
+			remove_object(record);
+			break;
+		case TRACE_COLLECT:
+			gc_.collect();
+			break;
+		}
+	}
+
+	// Objects left at the end of the trace are released along with the replayer.
+	child_objects_.clear();
+	root_objects_.clear();
+	storages_.clear();
+	gc_.collect();
+
+	// Records replayed before a truncated or corrupt one are not timed as a whole trace.
+	if (!is_valid || !reader.is_valid()) {
+		return std::nullopt;
+	}
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
 }
 
-void GC::Impl::Storage::set_destructor(void(*destructor)(void*, const std::size_t), [[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+bool GC::Impl::Replayer::new_object(const TraceReader::Record& record)
 {
-	SABER_GC_ASSERT(destructor && locker && locker.mutex() == &impl_->mutex_);
-	SABER_GC_ASSERT(!destructor_);
+	if (record.count != 0 && record.size > std::numeric_limits<std::size_t>::max() / record.count) {
+		return false;
+	}
+	auto cell = find_cell(record.parent, record.offset);
+	if (!cell) {
+		return false;
+	}
 
-	destructor_ = destructor;
+	// Every byte of the storage is covered by a cell, so that children at different offsets never share a cell.
+	auto bytes = static_cast<std::size_t>(record.size * record.count);
+	auto count = std::max<std::size_t>(bytes / sizeof(Cell) + (bytes % sizeof(Cell) != 0 ? 1 : 0), 1);
+
+	auto&& object = emplace_object(record.object, *cell);
+	object = gc_.new_array<Cell[]>(count);
+	storages_.insert_or_assign(record.storage, std::make_pair(object.get(), count));
+	return true;
 }
 
-void GC::Impl::Storage::add_child(const BaseObject* object, [[maybe_unused]] const std::unique_lock<std::mutex>& locker)
+bool GC::Impl::Replayer::copy_object(const TraceReader::Record& record)
 {
-	SABER_GC_ASSERT(object && locker && locker.mutex() == &impl_->mutex_);
+	auto cell = find_cell(record.parent, record.offset);
+	if (!cell) {
+		return false;
+	}
 
-	child_objects_.push_back(object);
+	// Objects copied from outside of the trace are unknown.
+	if (auto from = find_object(record.from)) {
+		auto&& object = emplace_object(record.object, *cell);
+		object = *from;
+	}
+	return true;
 }
 
-bool GC::Impl::Storage::is_marked([[maybe_unused]] const std::unique_lock<std::mutex>& locker) const noexcept
+void GC::Impl::Replayer::remove_object(const TraceReader::Record& record)
 {
-	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	if (root_objects_.erase(record.object) > 0) {
+		return;
+	}
 
-	return is_marked_;
+	if (auto found = child_objects_.find(record.object); found != child_objects_.end()) {
+		found->second->reset();
+		child_objects_.erase(found);
+	}
 }
 
-void GC::Impl::Storage::mark(const std::unique_lock<std::mutex>& locker)
+GC::Object<GC::Impl::Replayer::Cell[]>* GC::Impl::Replayer::find_object(const std::uintmax_t object) const
 {
-	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	if (auto found = root_objects_.find(object); found != root_objects_.end()) {
+		return found->second.get();
+	}
 
-	if (!is_marked_) {
-		is_marked_ = true;
-		for (auto&& child_object : child_objects_) {
-			impl_->mark_child_object(child_object, locker);
+	if (auto found = child_objects_.find(object); found != child_objects_.end()) {
+		return found->second;
+	}
+
+	return nullptr;
+}
+
+// Returns null if the parent is unknown, or nothing if the offset is out of its storage.
+std::optional<GC::Impl::Replayer::Cell*> GC::Impl::Replayer::find_cell(const std::uintmax_t parent, const std::uintmax_t offset) const
+{
+	if (auto found = storages_.find(parent); parent != 0 && found != storages_.end()) {
+		if (offset / sizeof(Cell) >= found->second.second) {
+			return std::nullopt;
 		}
+		return found->second.first + offset / sizeof(Cell);
 	}
+	return nullptr;
 }
 
-void GC::Impl::Storage::unmark([[maybe_unused]] const std::unique_lock<std::mutex>& locker) noexcept
+GC::Object<GC::Impl::Replayer::Cell[]>& GC::Impl::Replayer::emplace_object(const std::uintmax_t object, Cell* cell)
 {
-	SABER_GC_ASSERT(locker && locker.mutex() == &impl_->mutex_);
+	// Children whose parent is unknown are replayed as roots.
+	if (cell) {
+		root_objects_.erase(object);
+		child_objects_.insert_or_assign(object, &cell->object);
+		return cell->object;
+	}
 
-	is_marked_ = false;
+	child_objects_.erase(object);
+	auto&& root_object = root_objects_[object];
+	if (!root_object) {
+		root_object = std::make_unique<Object<Cell[]>>();
+	}
+	return *root_object;
 }
 
 
@@ -408,6 +3310,23 @@ GC::BaseObject::BaseObject(const BaseObject& other)
 	}
 }
 
+GC::BaseObject::BaseObject(const BaseLocal& local)
+	: storage_{ local.storage_ }
+	, count_{ 0 }
+{
+	if (storage_) {
+		auto impl = local.stack_->get_impl()->shared_from_this();
+		auto locker = impl->lock();
+		if (impl->copy_local(this, &local, storage_, locker)) {
+			impl_ = std::move(impl);
+		}
+		else {
+			// Switch to weak_ptr<Impl> since this is a child object.
+			impl_ = std::weak_ptr<Impl>{ impl };
+		}
+	}
+}
+
 GC::BaseObject::~BaseObject()
 {
 	if (storage_) {
@@ -417,6 +3336,8 @@ GC::BaseObject::~BaseObject()
 			if constexpr (std::is_same_v<T, std::shared_ptr<Impl>>) {
 				auto locker = impl->lock();
 				impl->remove_object(this, locker);
+				locker.unlock();
+				impl->reclaim_storages();
 			}
 			else if constexpr (std::is_same_v<T, std::weak_ptr<Impl>>) {
 				// Note that shared_ptr<Impl> can not be obtained
@@ -424,6 +3345,8 @@ GC::BaseObject::~BaseObject()
 				if (auto shared = impl.lock()) {
 					auto locker = shared->lock();
 					shared->remove_object(this, locker);
+					locker.unlock();
+					shared->reclaim_storages();
 				}
 			}
 		}, impl_);
@@ -442,13 +3365,16 @@ GC::BaseObject& GC::BaseObject::operator=(const BaseObject& rhs)
 		Impl* pImpl = nullptr;
 
 		if (storage_) {
-			std::visit([this, &rhs, &pImpl](auto&& impl) {
+			std::visit([this, &rhs, &pImpl, old_storage](auto&& impl) {
 				using T = std::decay_t<decltype(impl)>;
 
 				if constexpr (std::is_same_v<T, std::shared_ptr<Impl>>) {
 					pImpl = impl.get();
 					auto locker = impl->lock();
-					if (!impl->copy_object(this, &rhs, true, locker)) {
+					auto is_root_object = impl->copy_object(this, &rhs, old_storage != nullptr, locker);
+					locker.unlock();
+					impl->reclaim_storages();
+					if (!is_root_object) {
 						// Switch to weak_ptr<Impl> since this is a child object.
 						impl_ = std::weak_ptr<Impl>{ impl };
 					}
@@ -457,7 +3383,10 @@ GC::BaseObject& GC::BaseObject::operator=(const BaseObject& rhs)
 					auto shared = std::shared_ptr<Impl>{ impl };
 					pImpl = shared.get();
 					auto locker = shared->lock();
-					if (shared->copy_object(this, &rhs, true, locker)) {
+					auto is_root_object = shared->copy_object(this, &rhs, old_storage != nullptr, locker);
+					locker.unlock();
+					shared->reclaim_storages();
+					if (is_root_object) {
 						// Switch to shared_ptr<Impl> since this is a root object.
 						impl_ = std::move(shared);
 					}
@@ -473,6 +3402,8 @@ GC::BaseObject& GC::BaseObject::operator=(const BaseObject& rhs)
 					if (impl.get() != pImpl) {
 						auto locker = impl->lock();
 						impl->remove_object(this, locker);
+						locker.unlock();
+						impl->reclaim_storages();
 					}
 				}
 				else if constexpr (std::is_same_v<T, std::weak_ptr<Impl>>) {
@@ -480,6 +3411,8 @@ GC::BaseObject& GC::BaseObject::operator=(const BaseObject& rhs)
 					if (shared.get() != pImpl) {
 						auto locker = shared->lock();
 						shared->remove_object(this, locker);
+						locker.unlock();
+						shared->reclaim_storages();
 					}
 				}
 			}, old_impl);
@@ -488,19 +3421,25 @@ GC::BaseObject& GC::BaseObject::operator=(const BaseObject& rhs)
 	return *this;
 }
 
-void GC::BaseObject::set_destructor(void(*destructor)(void*, const std::size_t), const std::size_t count)
+GC::BaseObject& GC::BaseObject::operator=(const BaseLocal& rhs)
+{
+	// Assigns via a temporary object, since it is registered to Impl anyway.
+	return *this = BaseObject{ rhs };
+}
+
+void GC::BaseObject::set_destructor(void(*destructor)(void*, const std::size_t), const std::size_t count, const bool is_relocatable)
 {
 	SABER_GC_ASSERT(destructor);
 
 	SABER_GC_TRY {
-		std::visit([this, destructor](auto&& impl) {
+		std::visit([this, destructor, is_relocatable](auto&& impl) {
 			using T = std::decay_t<decltype(impl)>;
 
 			if constexpr (std::is_same_v<T, std::shared_ptr<Impl>>) {
-				impl->set_destructor(storage_, destructor);
+				impl->set_destructor(storage_, destructor, is_relocatable);
 			}
 			else if constexpr (std::is_same_v<T, std::weak_ptr<Impl>>) {
-				std::shared_ptr<Impl>{ impl }->set_destructor(storage_, destructor);
+				std::shared_ptr<Impl>{ impl }->set_destructor(storage_, destructor, is_relocatable);
 			}
 		}, impl_);
 	}
@@ -519,11 +3458,15 @@ void GC::BaseObject::reset()
 			if constexpr (std::is_same_v<T, std::shared_ptr<Impl>>) {
 				auto locker = impl->lock();
 				impl->remove_object(this, locker);
+				locker.unlock();
+				impl->reclaim_storages();
 			}
 			else if constexpr (std::is_same_v<T, std::weak_ptr<Impl>>) {
 				auto shared = std::shared_ptr<Impl>{ impl };
 				auto locker = shared->lock();
 				shared->remove_object(this, locker);
+				locker.unlock();
+				shared->reclaim_storages();
 			}
 		}, impl_);
 
@@ -533,4 +3476,129 @@ void GC::BaseObject::reset()
 	}
 }
 
+
+GC::BaseLocal::BaseLocal() noexcept
+	: storage_{ nullptr }
+	, stack_{ nullptr }
+	, index_{ 0 }
+{
+}
+
+GC::BaseLocal::BaseLocal(const BaseObject& object)
+	: BaseLocal{}
+{
+	*this = object;
+}
+
+GC::BaseLocal::BaseLocal(const BaseLocal& other)
+	: BaseLocal{}
+{
+	assign(other.storage_, other.stack_, &other);
+}
+
+GC::BaseLocal::BaseLocal(BaseLocal&& other)
+	: storage_{ other.storage_ }
+	, stack_{ other.stack_ }
+	, index_{ other.index_ }
+{
+	// Takes over the slot.
+	if (stack_) {
+		other.storage_ = nullptr;
+		other.stack_ = nullptr;
+		stack_->get_impl()->trace_copy_local(this, &other, false);
+		stack_->get_impl()->trace_remove_local(&other);
+	}
+}
+
+GC::BaseLocal::~BaseLocal()
+{
+	reset();
+}
+
+GC::BaseLocal& GC::BaseLocal::operator=(const BaseObject& rhs)
+{
+	ShadowStack* stack = nullptr;
+	if (rhs.storage_) {
+		stack = std::visit([](auto&& impl) {
+			using T = std::decay_t<decltype(impl)>;
+
+			if constexpr (std::is_same_v<T, std::shared_ptr<Impl>>) {
+				return &impl->get_shadow_stack();
+			}
+			else if constexpr (std::is_same_v<T, std::weak_ptr<Impl>>) {
+				return &std::shared_ptr<Impl>{ impl }->get_shadow_stack();
+			}
+		}, rhs.impl_);
+	}
+
+	assign(rhs.storage_, stack, &rhs);
+	return *this;
+}
+
+GC::BaseLocal& GC::BaseLocal::operator=(const BaseLocal& rhs)
+{
+	if (this != &rhs) {
+		assign(rhs.storage_, rhs.stack_, &rhs);
+	}
+	return *this;
+}
+
+GC::BaseLocal& GC::BaseLocal::operator=(BaseLocal&& rhs)
+{
+	if (this != &rhs) {
+		reset();
+
+		// Takes over the slot.
+		if (rhs.stack_) {
+			storage_ = rhs.storage_;
+			stack_ = rhs.stack_;
+			index_ = rhs.index_;
+			rhs.storage_ = nullptr;
+			rhs.stack_ = nullptr;
+			stack_->get_impl()->trace_copy_local(this, &rhs, false);
+			stack_->get_impl()->trace_remove_local(&rhs);
+		}
+	}
+	return *this;
+}
+
+void GC::BaseLocal::reset()
+{
+	if (stack_) {
+		stack_->pop(index_);
+		stack_->get_impl()->trace_remove_local(this);
+	}
+
+	storage_ = nullptr;
+	stack_ = nullptr;
+	index_ = 0;
+}
+
+void GC::BaseLocal::assign(void* storage, ShadowStack* stack, const void* from)
+{
+	if (!storage) {
+		reset();
+		return;
+	}
+
+	SABER_GC_ASSERT(stack);
+
+	// Overwrites the slot if it is of the same GC.
+	if (stack_ && stack_ != stack) {
+		reset();
+	}
+
+	auto overwrite = stack_ != nullptr;
+	if (overwrite) {
+		stack_->set(index_, storage);
+	}
+	else {
+		index_ = stack->push(storage);
+		stack_ = stack;
+	}
+	storage_ = storage;
+
+	stack_->get_impl()->trace_copy_local(this, from, overwrite);
+}
+
 } // namespace saber